@@ -1,9 +1,26 @@
+#define _POSIX_C_SOURCE 200809L // shm_open, mmap, ftruncate, pthreads
+
 #include "SDL.h"
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 
 //====================== DATA TYPES ======================//
 
@@ -19,8 +36,50 @@ typedef struct {
     uint32_t bg_colour;     // RRGGBBAA
     uint32_t scaler;        // scale each pixel by this value
     uint32_t clk_speed;     // intructions per sec
+    uint8_t quirks;         // QUIRK_* behaviours of the ROM's interpreter
+    bool quirks_set;        // quirks given by --quirks or the catalog
+    SDL_Keycode keymap[16]; // Host key for each CHIP8 key
+    char *catalog_name;     // ROM catalog index file
+    bool catalog_set;       // catalog_name given by --catalog
+    bool scan;              // Build the catalog from the directories given
+    bool detect_quirks;     // Pick quirks by trial runs (--detect-quirks)
+    bool vip_timing;        // Time instructions like a COSMAC VIP instead
+    char *rom_name;         // ROM file to load
+    char **rom_names;       // Every ROM given, for multi-session mode
+    uint32_t n_roms;        // Number of rom_names
+    uint32_t sessions;      // Machines to run tiled in one window (--tile)
+    uint32_t tile_cols;     // Window layout in 64x32 tiles
+    uint32_t tile_rows;
+    char *shm_name;         // POSIX shm segment to export frames to, or NULL
+    char *record_name;      // File to record frames to, or NULL
+    char *convert_in;       // Recording to convert to PBM (--convert mode)
+    char *convert_out;      // PBM output file for --convert
+    uint32_t run_ahead;     // Frames to run ahead of the shown frame
+    bool watch_rom;         // Reload the ROM whenever the file changes
+    char *coverage_name;    // Coverage report file prefix (COVERAGE builds)
+    bool debugger;          // Start stopped in the debugger (--debugger)
+    FILE *stats_file;       // Once a second stats line goes here, or NULL
+    char *trace_name;       // Chrome trace JSON written on exit, or NULL
+    char *server_name;      // Job server socket path, "-" for stdin
 } config_t;
 
+// Host window and UI state, changed by handle_input() while running
+typedef struct {
+    uint32_t focus;   // Session that receives keyboard input
+    bool debug_break; // Break into the debugger at next instruction
+    bool hud;         // Draw the performance overlay (F3)
+    bool hidden;      // Window minimized or hidden; nothing is drawn
+    bool unfocused;   // Window lost input focus; drawn at 15 fps
+} host_t;
+
+// Interpreter quirks; 0 is this emulator's original behaviour
+#define QUIRK_SHIFT_VX 0x01     // 8XY6/8XYE shift VX in place, ignoring VY
+#define QUIRK_KEEP_I 0x02       // FX55/FX65 leave I unchanged
+#define QUIRK_JUMP_VX 0x04      // BNNN jumps to XNN + VX (BXNN)
+#define QUIRK_CLIP_SPRITES 0x08 // DXYN clips at screen edges instead of
+                                // wrapping
+#define QUIRK_ALL 0x0F
+
 // Emulator states
 typedef enum { QUIT, RUNNING, PAUSED } emulator_state_t;
 
@@ -34,10 +93,21 @@ typedef struct {
 
 } instruction_t;
 
+// Ram is split into refcounted pages shared between clones of a machine
+// (see clone_chip8) and copied only when a clone writes to one
+#define RAM_SIZE 4096
+#define RAM_PAGE_SIZE 256
+#define RAM_PAGES (RAM_SIZE / RAM_PAGE_SIZE)
+
+typedef struct {
+    _Atomic uint32_t refs; // Machines using this page
+    uint8_t data[RAM_PAGE_SIZE];
+} ram_page_t;
+
 // Chip8 Machine
 typedef struct {
     emulator_state_t state;
-    uint8_t ram[4096];
+    ram_page_t *ram[RAM_PAGES]; // Read with RAM(), write with write_ram()
     bool display[64 * 32]; // Original Chip8 resolution
     uint8_t V[16];         // Registers V0 to VF
     uint16_t stack[12];    // Sub routine stack
@@ -49,8 +119,259 @@ typedef struct {
     uint16_t PC;           // Program Counter
     char *rom_name;        // Currently running ROM
     instruction_t inst;    // Current Instruction
+    uint32_t rng;          // CXNN random state, part of the machine so that
+                           // copies replay identically
+    bool any_key_pressed;  // FX0A has seen a key go down
+    uint8_t key;           // Key FX0A is waiting to be released
+    uint16_t rom_size;     // Bytes loaded at the entry point
+    uint8_t faults;        // FAULT_* flags for things the ROM got wrong
+    int32_t cycle_budget;  // VIP timing: machine cycles left in this frame
+    uint8_t quirks;        // QUIRK_* behaviours of the emulated interpreter
+    bool vip_timing;       // COSMAC VIP instruction timing (see --vip)
+#ifdef COVERAGE
+    uint8_t cov_exec[4096 / 8];  // Addresses fetched as an opcode
+    uint8_t cov_read[4096 / 8];  // Addresses read as data by DXYN/FX65
+    uint8_t cov_write[4096 / 8]; // Addresses written by FX33/FX55
+#endif
 } chip8_t;
 
+// Machine faults; the offending instruction is skipped and the flag set
+#define FAULT_STACK_OVERFLOW 0x01  // 2NNN with all 12 stack entries used
+#define FAULT_STACK_UNDERFLOW 0x02 // 00EE with an empty stack
+#define FAULT_BAD_OPCODE 0x04      // Opcode not implemented
+#define FAULT_NO_MEMORY 0x08       // No memory to copy a shared ram page
+
+// Byte at ram address addr (wrapped at 4K) of a machine, read only
+#define RAM(chip8, addr)                                                       \
+    ((chip8)->ram[((addr) & 0xFFF) / RAM_PAGE_SIZE]                            \
+         ->data[(addr) % RAM_PAGE_SIZE])
+
+// Marks ram address addr in one of the coverage bitmaps; a no-op unless built
+// with -DCOVERAGE
+#ifdef COVERAGE
+#define COVER(chip8, map, addr)                                                \
+    ((chip8)->map[((addr) & 0xFFF) / 8] |= 1 << ((addr) % 8))
+#else
+#define COVER(chip8, map, addr) ((void)0)
+#endif
+
+// Shared memory frame export, mapped by external processes (see --shm)
+// Readers: load seq, copy what they need, load seq again; retry if it was odd
+// or changed in between. Writers to keypad_inject hold CHIP8 key N with bit N.
+#define SHM_MAGIC 0x48533843 // "C8SH"
+#define SHM_VERSION 1
+
+typedef struct {
+    uint32_t magic;                 // SHM_MAGIC once the segment is ready
+    uint32_t version;               // SHM_VERSION
+    uint32_t width;                 // Display width in pixels
+    uint32_t height;                // Display height in pixels
+    _Atomic uint32_t seq;           // Seqlock; odd while a frame is written
+    _Atomic uint16_t keypad_inject; // Keys held by external process
+    uint16_t reserved;
+    _Atomic uint64_t frame;           // Frames published so far
+    uint8_t display[64 * 32 / 8];     // 1 bit per pixel, MSB first, row major
+} shm_frame_t;
+
+typedef struct {
+    shm_frame_t *frame; // Mapped segment, NULL when export is disabled
+    uint16_t keys;      // keypad_inject value applied last frame
+} shm_t;
+
+// Background frame recorder (see --record)
+// The emulation thread pushes packed frames into a single producer, single
+// consumer ring; a worker thread delta + RLE encodes them to disk. File format:
+//   "CHIP8REC" magic, width and height as 16 bit little endian, then per frame
+//   one byte of frames dropped before it (converter repeats the previous
+//   frame), then (skip, literal count, literals...) runs over the frame XOR'd
+//   with the previous one until all bytes are covered. More than 255 dropped
+//   frames are written as extra unchanged frames.
+#define RECORD_MAGIC "CHIP8REC"
+#define RECORD_SLOTS 64 // Power of 2, a bit over 1 second of frames
+
+typedef struct {
+    uint8_t display[64 * 32 / 8]; // Packed frame, as from pack_display()
+    uint32_t dropped;             // Frames lost to a full ring before this one
+} record_slot_t;
+
+typedef struct {
+    FILE *file;                    // NULL when recording is disabled
+    pthread_t worker;              // Encoder thread
+    atomic_bool running;           // Cleared to make the worker drain and exit
+    _Atomic uint32_t head;         // Next slot to write, owned by emulation
+    _Atomic uint32_t tail;         // Next slot to read, owned by worker
+    uint32_t dropped;              // Frames dropped since last pushed frame
+    uint64_t frames;               // Frames written by the worker
+    record_slot_t slots[RECORD_SLOTS];
+} recorder_t;
+
+// ROM file watcher (see --watch)
+typedef struct {
+    int fd;         // Non blocking inotify descriptor, -1 when not watching
+    char *dir;      // Directory holding the ROM
+    char *file;     // ROM file name inside dir
+} rom_watch_t;
+
+// Runtime debugger (see --debugger, F1)
+#define MAX_BREAKPOINTS 32
+#define MAX_WATCHPOINTS 32
+
+// Register a breakpoint condition is checked against
+typedef enum { COND_NONE = -1, COND_I = 16 } break_reg_t; // 0-15 is V0-VF
+
+typedef struct {
+    uint16_t addr;  // Break when PC reaches this address...
+    int8_t reg;     // ...and, unless COND_NONE, V[reg] or I (COND_I)...
+    char op;        // ...compares ('=', '!', '<', '>') ...
+    uint16_t value; // ...to value
+} breakpoint_t;
+
+typedef struct {
+    uint16_t addr; // ram address to watch for writes
+    uint8_t last;  // Value seen after the last instruction
+} watchpoint_t;
+
+typedef struct {
+    uint32_t steps;     // Break after this many more instructions, 0 = off
+    int32_t step_over;  // Temporary breakpoint for step over, or -1
+    uint32_t n_breaks;
+    uint32_t n_watches;
+    breakpoint_t breaks[MAX_BREAKPOINTS];
+    watchpoint_t watches[MAX_WATCHPOINTS];
+} debugger_t;
+
+// 60Hz frame pacing against deadlines counted from one start point, so
+// sleep rounding does not add up into drift
+typedef struct {
+    uint64_t start;  // Counter value pacing (re)started at
+    uint64_t frames; // Frames paced since then
+} pacer_t;
+
+// Performance counters, summed over one second windows (see F3, --stats)
+typedef struct {
+    uint64_t freq;           // SDL performance counter ticks per second
+    uint64_t window_start;   // Counter value when this window started
+    clock_t cpu_start;       // Process CPU time when this window started
+    uint32_t frames;         // Frames run this window
+    uint64_t instructions;   // Instructions run this window
+    uint64_t emu_ticks;      // Time in emulation, including run ahead
+    uint64_t render_ticks;   // Time drawing in update_screen and the HUD
+    uint64_t present_ticks;  // Time in SDL_RenderPresent (vsync wait)
+    uint64_t sleep_ticks;    // Time in SDL_Delay
+
+    // Results of the last complete window, shown by the HUD
+    double ips;              // Instructions per second achieved
+    double emu_ms;           // Per frame averages in milliseconds
+    double render_ms;
+    double present_ms;
+    double sleep_ms;
+    uint32_t dropped;        // Frames short of 60 in the window
+    double cpu_percent;      // Host CPU use of the whole process
+} stats_t;
+
+// Frame timeline tracer (see --trace). Spans go into a buffer allocated up
+// front and are only formatted as Chrome trace event JSON on exit.
+#define TRACE_MAX_SPANS (1u << 18) // About 10 minutes at 60 fps
+
+typedef enum {
+    SPAN_FRAME,
+    SPAN_INPUT,
+    SPAN_EMULATE,
+    SPAN_DELAY,
+    SPAN_RUN_AHEAD,
+    SPAN_SCREEN,
+    SPAN_PRESENT,
+    SPAN_TIMERS,
+} span_t;
+
+typedef struct {
+    uint64_t begin; // SDL performance counter values
+    uint64_t end;
+    span_t span;
+} trace_span_t;
+
+typedef struct {
+    trace_span_t *spans; // NULL when tracing is disabled
+    uint32_t count;
+    uint32_t dropped;    // Spans lost after the buffer filled up
+    uint64_t start;      // Counter value trace timestamps are relative to
+} tracer_t;
+
+// Key changes queued by handle_input() with their position inside the next
+// frame, so emulate_frame() applies each at the instruction it happened at
+// rather than all at the frame boundary
+#define MAX_KEY_EVENTS 64
+
+typedef struct {
+    uint16_t at; // Position in the frame, 1/65536ths of it
+    uint8_t key;
+    bool down;
+} key_event_t;
+
+typedef struct {
+    uint32_t last_poll; // SDL_GetTicks() when input was last polled
+    uint32_t count;
+    key_event_t events[MAX_KEY_EVENTS];
+} input_queue_t;
+
+// Headless job server (see --server). Job lines from a client are queued
+// for a pool of worker threads, each with its own machine reused across jobs.
+#define SERVER_QUEUE 256       // Jobs waiting for a worker
+#define SERVER_MAX_FRAMES 36000 // 10 minutes of emulated time per job
+#define SERVER_MAX_KEYS 64     // Entries in a job's input script
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;       // Queue empty and no job running
+    char *jobs[SERVER_QUEUE];  // Ring of job lines, owned by the queue
+    uint32_t head;
+    uint32_t count;
+    uint32_t busy;             // Jobs being run by workers
+    bool closing;              // Workers exit once the queue is empty
+    int out_fd;                // Current client; replies are written whole
+    pthread_mutex_t out_lock;
+    const config_t *config;
+} job_server_t;
+
+// One trial run of --detect-quirks: the ROM run headless under one set of
+// quirks, scored on how sane it looked
+#define DETECT_FRAMES 300 // 5 seconds of emulated time
+
+typedef struct {
+    chip8_t chip8;
+    const config_t *config;
+    int32_t score;
+} quirk_trial_t;
+
+// ROM catalog (see --scan). A file mapped straight into memory: a header and
+// an open addressing hash table of per-ROM settings, keyed by a hash of the
+// ROM contents so renamed or copied ROMs are still found.
+#define CATALOG_MAGIC "C8CATLG1"
+#define CATALOG_MAX_ROM (4096 - 0x200) // Largest ROM that fits in ram
+
+typedef struct {
+    uint64_t hash;      // FNV-1a of the ROM, 0 for an empty slot
+    uint32_t clk_speed; // 0 keeps the default
+    uint8_t quirks;
+    uint8_t reserved[3];
+    int32_t keymap[16]; // 0 keeps the default key
+    char path[256];     // Where the ROM was found, for listing
+} catalog_entry_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t n_slots;          // Power of two
+    uint32_t n_roms;
+    catalog_entry_t entries[]; // n_slots of them
+} catalog_header_t;
+
+typedef struct {
+    catalog_header_t *map; // NULL when there is no catalog
+    size_t size;
+} catalog_t;
+
 //====================== INITIALIZER FUNCTIONS ======================//
 
 // SDL Initializer
@@ -60,10 +381,10 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
         return false;
     }
 
-    sdl->window = SDL_CreateWindow("Chip8 Emulator", SDL_WINDOWPOS_CENTERED,
-                                   SDL_WINDOWPOS_CENTERED,
-                                   config->window_width * config->scaler,
-                                   config->window_height * config->scaler, 0);
+    sdl->window = SDL_CreateWindow(
+        "Chip8 Emulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        config->window_width * config->tile_cols * config->scaler,
+        config->window_height * config->tile_rows * config->scaler, 0);
 
     if (!sdl->window) {
         SDL_Log("Could not initialize window %s\n", SDL_GetError());
@@ -79,8 +400,38 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
     return true;
 }
 
+// Named quirk profiles
+typedef struct {
+    const char *name;
+    uint8_t quirks;
+} quirk_profile_t;
+
+static const quirk_profile_t quirk_profiles[] = {
+    {"default", 0},
+    {"vip", QUIRK_CLIP_SPRITES},
+    {"schip", QUIRK_ALL},
+};
+
+// Parses a quirk profile name or a number made of QUIRK_* bits
+bool parse_quirks(const char *text, uint8_t *quirks) {
+    for (uint32_t i = 0; i < sizeof quirk_profiles / sizeof quirk_profiles[0];
+         i++) {
+        if (strcmp(text, quirk_profiles[i].name) == 0) {
+            *quirks = quirk_profiles[i].quirks;
+            return true;
+        }
+    }
+
+    char *end;
+    const unsigned long value = strtoul(text, &end, 0);
+    if (!*text || *end || value > QUIRK_ALL)
+        return false;
+    *quirks = value;
+    return true;
+}
+
 // Set up initial configues to default or from command line
-bool init_config(config_t *config) {
+bool init_config(config_t *config, const int argc, char **argv) {
 
     // Defaults
     *config = (config_t){
@@ -90,17 +441,279 @@ bool init_config(config_t *config) {
         .fg_colour = 0x01BF3AFF,
         .scaler = 20,
         .clk_speed = 800,
+        .coverage_name = "coverage",
+        .sessions = 1,
+        .tile_cols = 1,
+        .tile_rows = 1,
+        .catalog_name = "chip8.idx",
+        .keymap =
+            {
+                [0x1] = SDLK_1, [0x2] = SDLK_2, [0x3] = SDLK_3, [0xC] = SDLK_4,
+                [0x4] = SDLK_q, [0x5] = SDLK_w, [0x6] = SDLK_e, [0xD] = SDLK_r,
+                [0x7] = SDLK_a, [0x8] = SDLK_s, [0x9] = SDLK_d, [0xE] = SDLK_f,
+                [0xA] = SDLK_z, [0x0] = SDLK_x, [0xB] = SDLK_c, [0xF] = SDLK_v,
+            },
 
     };
 
+    config->rom_names = calloc(argc, sizeof *config->rom_names);
+    if (!config->rom_names)
+        return false;
+
+    // Override defaults from passed in arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            config->shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            config->record_name = argv[++i];
+        } else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            config->run_ahead = strtoul(argv[++i], NULL, 10);
+            if (config->run_ahead > 8) {
+                SDL_Log("Run ahead of %u frames is too far, max 8\n",
+                        config->run_ahead);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            if (!parse_quirks(argv[++i], &config->quirks)) {
+                SDL_Log("Unknown quirk profile %s\n", argv[i]);
+                return false;
+            }
+            config->quirks_set = true;
+        } else if (strcmp(argv[i], "--detect-quirks") == 0) {
+            config->detect_quirks = true;
+        } else if (strcmp(argv[i], "--catalog") == 0 && i + 1 < argc) {
+            config->catalog_name = argv[++i];
+            config->catalog_set = true;
+        } else if (strcmp(argv[i], "--scan") == 0) {
+            config->scan = true;
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            config->server_name = argv[++i];
+        } else if (strcmp(argv[i], "--vip") == 0) {
+            config->vip_timing = true;
+        } else if (strcmp(argv[i], "--debugger") == 0) {
+            config->debugger = true; // Start stopped at the entry point
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            config->stats_file = stderr;
+        } else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            config->stats_file = fopen(argv[++i], "w");
+            if (!config->stats_file) {
+                SDL_Log("Could not open stats file %s\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+            char *end;
+            const unsigned long n = strtoul(argv[++i], &end, 10);
+            if (*end || n < 1 || n > 256) {
+                SDL_Log("--tile needs 1 to 256 sessions, not %s\n", argv[i]);
+                return false;
+            }
+            config->sessions = n;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            config->trace_name = argv[++i];
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            config->watch_rom = true;
+#ifdef COVERAGE
+        } else if (strcmp(argv[i], "--coverage") == 0 && i + 1 < argc) {
+            config->coverage_name = argv[++i];
+#endif
+        } else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+            config->convert_in = argv[++i];
+            config->convert_out = argv[++i];
+        } else if (argv[i][0] == '-') {
+            SDL_Log("Unknown or incomplete option %s\n", argv[i]);
+            return false;
+        } else {
+            config->rom_names[config->n_roms++] = argv[i];
+        }
+    }
+
+    if (!config->n_roms && !config->convert_in && !config->server_name) {
+        SDL_Log("No ROM file given\n");
+        return false;
+    }
+    config->rom_name = config->rom_names[0];
+
+    // Several ROMs run side by side, at least one session each
+    if (config->n_roms > config->sessions)
+        config->sessions = config->n_roms;
+
+    if (config->sessions > 1) {
+        // Near square grid of tiles, scaled down to fit a typical screen
+        while (config->tile_cols * config->tile_cols < config->sessions)
+            config->tile_cols++;
+        config->tile_rows =
+            (config->sessions + config->tile_cols - 1) / config->tile_cols;
+        const uint32_t max_width = 1280;
+        const uint32_t fit =
+            max_width / (config->window_width * config->tile_cols);
+        if (config->scaler > fit)
+            config->scaler = fit ? fit : 1;
+    }
+
     return true;
 }
 
-// Machine initializer
-bool init_chip8(chip8_t *chip8, char rom_name[]) {
+// Shared memory frame export initializer
+bool init_shm(shm_t *shm, const config_t *config) {
+    if (!config->shm_name)
+        return true; // Export not requested
+
+    const int fd = shm_open(config->shm_name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        SDL_Log("Could not open shared memory %s\n", config->shm_name);
+        return false;
+    }
+
+    if (ftruncate(fd, sizeof *shm->frame) != 0) {
+        SDL_Log("Could not size shared memory %s\n", config->shm_name);
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, sizeof *shm->frame, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd); // Mapping stays valid after the descriptor is closed
+    if (map == MAP_FAILED) {
+        SDL_Log("Could not map shared memory %s\n", config->shm_name);
+        return false;
+    }
+
+    shm->frame = map;
+    memset(shm->frame, 0, sizeof *shm->frame);
+    shm->frame->version = SHM_VERSION;
+    shm->frame->width = config->window_width;
+    shm->frame->height = config->window_height;
+    atomic_thread_fence(memory_order_release);
+    shm->frame->magic = SHM_MAGIC; // Readers may start once this is set
+    shm->keys = 0;
+    return true;
+}
+
+// Writes one frame: its dropped count, then (skip, literal count,
+// literals...) runs over the delta
+void write_record(FILE *file, const uint8_t dropped, const uint8_t delta[],
+                  const uint32_t size) {
+    fputc(dropped, file);
+    for (uint32_t i = 0; i < size;) {
+        uint32_t skip = 0, lit = 0;
+        while (i + skip < size && skip < 255 && !delta[i + skip])
+            skip++;
+        while (i + skip + lit < size && lit < 255 && delta[i + skip + lit])
+            lit++;
+        fputc(skip, file);
+        fputc(lit, file);
+        fwrite(&delta[i + skip], 1, lit, file);
+        i += skip + lit;
+    }
+}
+
+// Encodes frames from the recorder ring until recording stops
+void *record_worker(void *arg) {
+    recorder_t *rec = arg;
+    uint8_t prev[sizeof rec->slots[0].display] = {0};
+
+    for (;;) {
+        const uint32_t tail =
+            atomic_load_explicit(&rec->tail, memory_order_relaxed);
+        const uint32_t head =
+            atomic_load_explicit(&rec->head, memory_order_acquire);
+
+        if (tail == head) {
+            // Ring empty; exit once the emulator has stopped pushing
+            if (!atomic_load_explicit(&rec->running, memory_order_acquire) &&
+                tail == atomic_load_explicit(&rec->head, memory_order_acquire))
+                break;
+            nanosleep(&(struct timespec){.tv_nsec = 4000000}, NULL); // 4ms
+            continue;
+        }
+
+        const record_slot_t *slot = &rec->slots[tail % RECORD_SLOTS];
+        uint8_t delta[sizeof prev];
+        for (uint32_t i = 0; i < sizeof delta; i++) {
+            delta[i] = slot->display[i] ^ prev[i];
+            prev[i] = slot->display[i];
+        }
+        uint32_t dropped = slot->dropped;
+        atomic_store_explicit(&rec->tail, tail + 1, memory_order_release);
+
+        // Dropped counts past one byte go out as unchanged frames of 254
+        // repeats each, 255 frames in all
+        const uint8_t unchanged[sizeof delta] = {0};
+        while (dropped > 255) {
+            write_record(rec->file, 254, unchanged, sizeof unchanged);
+            dropped -= 255;
+        }
+        write_record(rec->file, dropped, delta, sizeof delta);
+        rec->frames++;
+    }
+    return NULL;
+}
+
+// Background frame recorder initializer
+bool init_recorder(recorder_t *rec, const config_t *config) {
+    if (!config->record_name)
+        return true; // Recording not requested
+
+    rec->file = fopen(config->record_name, "wb");
+    if (!rec->file) {
+        SDL_Log("Could not open recording file %s\n", config->record_name);
+        return false;
+    }
+
+    // Header
+    fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), rec->file);
+    const uint8_t dims[] = {config->window_width & 0xFF,
+                            config->window_width >> 8,
+                            config->window_height & 0xFF,
+                            config->window_height >> 8};
+    fwrite(dims, 1, sizeof dims, rec->file);
+
+    atomic_init(&rec->head, 0);
+    atomic_init(&rec->tail, 0);
+    atomic_init(&rec->running, true);
+    rec->dropped = 0;
+    rec->frames = 0;
+
+    if (pthread_create(&rec->worker, NULL, record_worker, rec) != 0) {
+        SDL_Log("Could not start recording thread\n");
+        fclose(rec->file);
+        rec->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Frame timeline tracer initializer
+bool init_tracer(tracer_t *tracer, const config_t *config) {
+    *tracer = (tracer_t){.start = SDL_GetPerformanceCounter()};
+    if (!config->trace_name)
+        return true; // Tracing not requested
+
+    tracer->spans = malloc(TRACE_MAX_SPANS * sizeof *tracer->spans);
+    if (!tracer->spans) {
+        SDL_Log("Could not allocate trace buffer\n");
+        return false;
+    }
+    return true;
+}
+
+// Releases a machine's ram pages; the machine must be loaded again before use
+void cleanup_chip8(chip8_t *chip8) {
+    for (uint32_t i = 0; i < RAM_PAGES; i++) {
+        ram_page_t *page = chip8->ram[i];
+        if (page && atomic_fetch_sub_explicit(&page->refs, 1,
+                                              memory_order_acq_rel) == 1)
+            free(page);
+        chip8->ram[i] = NULL;
+    }
+}
+
+// Resets the machine, then loads the font and a ROM image from memory. The
+// machine must be zeroed or have been loaded before.
+bool load_chip8(chip8_t *chip8, const uint8_t rom[], const size_t rom_size) {
 
     const uint16_t entry_point = 0x200; // Strating point for ROM to be loaded
-    chip8->state = RUNNING;
+    const size_t max_size = RAM_SIZE - entry_point;
     const uint8_t font[] = {
         0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
         0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -120,53 +733,205 @@ bool init_chip8(chip8_t *chip8, char rom_name[]) {
         0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
 
+    // Checking for rom size
+    if (rom_size > max_size) {
+        SDL_Log("Rom file %zu is too big for ram %zu \n", rom_size, max_size);
+        return false;
+    }
+
+    // Keep pages no clone shares, so reloading a machine does not allocate
+    ram_page_t *pages[RAM_PAGES];
+    for (uint32_t i = 0; i < RAM_PAGES; i++) {
+        pages[i] = chip8->ram[i];
+        if (pages[i] && atomic_fetch_sub_explicit(&pages[i]->refs, 1,
+                                                  memory_order_acq_rel) != 1)
+            pages[i] = NULL; // Still used by a clone
+    }
+    *chip8 = (chip8_t){0};
+    chip8->state = RUNNING;
+
     // Loading Font into memory
-    memcpy(&chip8->ram[0], font, sizeof(font)); // Loading font
+    uint8_t ram[RAM_SIZE] = {0};
+    memcpy(&ram[0], font, sizeof(font)); // Loading font
+
+    // Loading Chip8 memory
+    memcpy(&ram[entry_point], rom, rom_size);
+
+    for (uint32_t i = 0; i < RAM_PAGES; i++) {
+        chip8->ram[i] = pages[i] ? pages[i] : malloc(sizeof *chip8->ram[i]);
+        if (!chip8->ram[i]) {
+            SDL_Log("Could not allocate ram\n");
+            for (uint32_t j = i + 1; j < RAM_PAGES; j++)
+                free(pages[j]);
+            cleanup_chip8(chip8);
+            return false;
+        }
+        atomic_init(&chip8->ram[i]->refs, 1);
+        memcpy(chip8->ram[i]->data, &ram[i * RAM_PAGE_SIZE], RAM_PAGE_SIZE);
+    }
+
+    // Initiating PC
+    chip8->PC = entry_point;
+    chip8->rom_size = rom_size;
+    chip8->stack_ptr = &chip8->stack[0];
+    return true;
+}
+
+// Machine initializer
+bool init_chip8(chip8_t *chip8, char rom_name[]) {
 
     // Opening ROM file
-    FILE *rom = fopen(rom_name, "rb");
-    if (!rom) {
+    const int fd = open(rom_name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
         SDL_Log("Rom file %s invalid or does not exits\n", rom_name);
+        if (fd >= 0)
+            close(fd);
         return false;
     }
-    // Finding size of ROM
-    fseek(rom, 0, SEEK_END);
-    const size_t max_size = sizeof chip8->ram - entry_point;
-    const size_t rom_size = ftell(rom);
-    rewind(rom);
 
-    // Checking for rom size
-    if (rom_size > max_size) {
+    // Map the ROM rather than reading it; load_chip8 rejects oversized ones
+    // and an empty file has nothing to map
+    const size_t rom_size = st.st_size;
+    static const uint8_t empty[1];
+    const uint8_t *data = empty;
+    if (rom_size) {
+        data = mmap(NULL, rom_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            SDL_Log("Could not read ROM onto memory\n");
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
 
-        SDL_Log("Rom file %zu is too big for ram %zu \n", rom_size, max_size);
+    const bool loaded = load_chip8(chip8, data, rom_size);
+    if (rom_size)
+        munmap((void *)data, rom_size);
+    if (!loaded)
         return false;
-    }
 
-    // Loading Chip8 memory
-    if (fread(&chip8->ram[entry_point], rom_size, 1, rom) != 1) {
-        SDL_Log("Could not read ROM onto memory\n");
+    chip8->rom_name = rom_name;
+    return true;
+}
+
+// ROM file watcher initializer
+bool init_rom_watch(rom_watch_t *watch, const config_t *config) {
+    watch->fd = -1;
+    if (!config->watch_rom)
+        return true; // Watching not requested
+
+    // Watch the directory rather than the file itself: assemblers and editors
+    // often replace the file with a rename, which would drop a file watch
+    const char *slash = strrchr(config->rom_name, '/');
+    watch->dir = slash ? strndup(config->rom_name, slash - config->rom_name + 1)
+                       : strdup(".");
+    watch->file = strdup(slash ? slash + 1 : config->rom_name);
+
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0 ||
+        inotify_add_watch(watch->fd, watch->dir, IN_CLOSE_WRITE | IN_MOVED_TO) <
+            0) {
+        SDL_Log("Could not watch %s for changes\n", watch->dir);
         return false;
     }
-    fclose(rom);
+    return true;
+}
 
-    // Initiating PC
-    chip8->PC = entry_point;
-    chip8->rom_name = rom_name;
-    chip8->stack_ptr = &chip8->stack[0];
+// Maps the ROM catalog if there is one. A damaged default chip8.idx only
+// turns the catalog off; one named with --catalog is an error.
+bool init_catalog(catalog_t *catalog, const config_t *config) {
+    *catalog = (catalog_t){0};
+    const int fd = open(config->catalog_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return true; // No catalog, every ROM runs with the defaults
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(catalog_header_t)) {
+        SDL_Log("Catalog %s is invalid\n", config->catalog_name);
+        close(fd);
+        return !config->catalog_set;
+    }
+
+    catalog_header_t *map =
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        SDL_Log("Could not map catalog %s\n", config->catalog_name);
+        return !config->catalog_set;
+    }
+
+    const uint32_t n_slots = map->n_slots;
+    if (memcmp(map->magic, CATALOG_MAGIC, sizeof map->magic) != 0 ||
+        !n_slots || (n_slots & (n_slots - 1)) || map->n_roms >= n_slots ||
+        sizeof *map + (size_t)n_slots * sizeof map->entries[0] >
+            (size_t)st.st_size) {
+        SDL_Log("Catalog %s is invalid\n", config->catalog_name);
+        munmap(map, st.st_size);
+        return !config->catalog_set;
+    }
+
+    catalog->map = map;
+    catalog->size = st.st_size;
     return true;
 }
 
 //====================== RUNTIME FUNCTIONS ======================//
 
-// CHIP8 Keypad     QWERTY
+// CHIP8 Keypad     QWERTY (default config->keymap)
 //   1 2 3 C        1 2 3 4
 //   4 5 6 D        q w e r
 //   7 8 9 E        a s d f
 //   A 0 B F        z x c v
 
-void handle_input(chip8_t *chip8) {
+// Applies whatever input is still queued
+void flush_input(chip8_t *chip8, input_queue_t *input) {
+    if (!input)
+        return;
+    for (uint32_t i = 0; i < input->count; i++)
+        chip8->keypad[input->events[i].key] = input->events[i].down;
+    input->count = 0;
+}
+
+// Applies a keypad change now, or queues it for emulate_frame() at the point
+// of the last frame's interval it happened at
+void set_key(chip8_t *chip8, input_queue_t *input, const uint32_t span,
+             const SDL_Event *event, const uint8_t key, const bool down) {
+    if (!input || input->count == MAX_KEY_EVENTS || !span) {
+        flush_input(chip8, input); // Keep the order of any queued changes
+        chip8->keypad[key] = down;
+        return;
+    }
+
+    // Events are stamped in SDL_GetTicks() milliseconds
+    uint32_t since = event->key.timestamp - input->last_poll;
+    if (since >= span)
+        since = span - 1; // Stamped while polling, or clock wrapped
+    input->events[input->count++] = (key_event_t){
+        .at = ((uint64_t)since << 16) / span,
+        .key = key,
+        .down = down,
+    };
+}
+
+// Polls SDL events. With input, keypad changes are queued with their time so
+// the next emulate_frame() spreads them over its batch the way they were
+// spread over the last frame; without, they apply at once.
+void handle_input(chip8_t *chip8, const config_t *config, host_t *host,
+                  input_queue_t *input) {
     SDL_Event event;
 
+    // Input queued last time is stale once a new frame's worth arrives
+    flush_input(chip8, input);
+    uint32_t span = 0;
+    if (input) {
+        // Pump first so no event taken below is stamped after now
+        SDL_PumpEvents();
+        const uint32_t now = SDL_GetTicks();
+        span = now - input->last_poll;
+        input->last_poll = now;
+    }
+
     while (SDL_PollEvent(&event)) {
         switch (event.type) {
         case SDL_QUIT:
@@ -191,117 +956,59 @@ void handle_input(chip8_t *chip8) {
                 }
                 break;
 
-            // Map qwerty keys to CHIP8 keypad
-            case SDLK_1:
-                chip8->keypad[0x1] = true;
-                break;
-            case SDLK_2:
-                chip8->keypad[0x2] = true;
-                break;
-            case SDLK_3:
-                chip8->keypad[0x3] = true;
-                break;
-            case SDLK_4:
-                chip8->keypad[0xC] = true;
-                break;
-
-            case SDLK_q:
-                chip8->keypad[0x4] = true;
-                break;
-            case SDLK_w:
-                chip8->keypad[0x5] = true;
-                break;
-            case SDLK_e:
-                chip8->keypad[0x6] = true;
-                break;
-            case SDLK_r:
-                chip8->keypad[0xD] = true;
+            case SDLK_F1:
+                // Break into the debugger on the terminal
+                host->debug_break = true;
                 break;
 
-            case SDLK_a:
-                chip8->keypad[0x7] = true;
-                break;
-            case SDLK_s:
-                chip8->keypad[0x8] = true;
-                break;
-            case SDLK_d:
-                chip8->keypad[0x9] = true;
-                break;
-            case SDLK_f:
-                chip8->keypad[0xE] = true;
+            case SDLK_F3:
+                // Toggle performance overlay
+                host->hud = !host->hud;
                 break;
 
-            case SDLK_z:
-                chip8->keypad[0xA] = true;
-                break;
-            case SDLK_x:
-                chip8->keypad[0x0] = true;
-                break;
-            case SDLK_c:
-                chip8->keypad[0xB] = true;
-                break;
-            case SDLK_v:
-                chip8->keypad[0xF] = true;
+            case SDLK_TAB:
+                // Move keyboard focus to the next tiled session
+                host->focus = (host->focus + 1) % config->sessions;
                 break;
 
             default:
+                // Map keys to CHIP8 keypad
+                for (uint8_t i = 0; i < sizeof chip8->keypad; i++) {
+                    if (event.key.keysym.sym == config->keymap[i])
+                        set_key(chip8, input, span, &event, i, true);
+                }
                 break;
             }
             break;
 
         case SDL_KEYUP:
-            switch (event.key.keysym.sym) {
-            // Map qwerty keys to CHIP8 keypad
-            case SDLK_1:
-                chip8->keypad[0x1] = false;
-                break;
-            case SDLK_2:
-                chip8->keypad[0x2] = false;
-                break;
-            case SDLK_3:
-                chip8->keypad[0x3] = false;
-                break;
-            case SDLK_4:
-                chip8->keypad[0xC] = false;
-                break;
+            // Map keys to CHIP8 keypad
+            for (uint8_t i = 0; i < sizeof chip8->keypad; i++) {
+                if (event.key.keysym.sym == config->keymap[i])
+                    set_key(chip8, input, span, &event, i, false);
+            }
+            break;
 
-            case SDLK_q:
-                chip8->keypad[0x4] = false;
-                break;
-            case SDLK_w:
-                chip8->keypad[0x5] = false;
-                break;
-            case SDLK_e:
-                chip8->keypad[0x6] = false;
-                break;
-            case SDLK_r:
-                chip8->keypad[0xD] = false;
+        case SDL_WINDOWEVENT:
+            // Track visibility and focus to save drawing work
+            switch (event.window.event) {
+            case SDL_WINDOWEVENT_HIDDEN:
+            case SDL_WINDOWEVENT_MINIMIZED:
+                host->hidden = true;
                 break;
 
-            case SDLK_a:
-                chip8->keypad[0x7] = false;
-                break;
-            case SDLK_s:
-                chip8->keypad[0x8] = false;
-                break;
-            case SDLK_d:
-                chip8->keypad[0x9] = false;
-                break;
-            case SDLK_f:
-                chip8->keypad[0xE] = false;
+            case SDL_WINDOWEVENT_SHOWN:
+            case SDL_WINDOWEVENT_EXPOSED:
+            case SDL_WINDOWEVENT_RESTORED:
+                host->hidden = false;
                 break;
 
-            case SDLK_z:
-                chip8->keypad[0xA] = false;
-                break;
-            case SDLK_x:
-                chip8->keypad[0x0] = false;
-                break;
-            case SDLK_c:
-                chip8->keypad[0xB] = false;
+            case SDL_WINDOWEVENT_FOCUS_LOST:
+                host->unfocused = true;
                 break;
-            case SDLK_v:
-                chip8->keypad[0xF] = false;
+
+            case SDL_WINDOWEVENT_FOCUS_GAINED:
+                host->unfocused = false;
                 break;
 
             default:
@@ -315,6 +1022,21 @@ void handle_input(chip8_t *chip8) {
     }
 }
 
+// Blocks until there is input to handle, for when nothing is running. With
+// --watch it wakes regularly to check the ROM file.
+void wait_input(const config_t *config) {
+    if (config->watch_rom)
+        SDL_WaitEventTimeout(NULL, 250);
+    else
+        SDL_WaitEvent(NULL);
+}
+
+// True if frame should be drawn: never while the window is hidden, and
+// every 4th frame while it is out of focus
+bool should_render(const host_t *host, const uint64_t frame) {
+    return !host->hidden && (!host->unfocused || frame % 4 == 0);
+}
+
 #ifdef DEBUG
 void debug_info(chip8_t *chip8) {
     printf("Address: 0x%04X, Opcode: 0x%04X Desc: ", chip8->PC - 2,
@@ -522,14 +1244,14 @@ void debug_info(chip8_t *chip8) {
             printf("Skip next instruction if key in V%X (0x%02X) is pressed; "
                    "Keypad value: %d\n",
                    chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->keypad[chip8->V[chip8->inst.X]]);
+                   chip8->keypad[chip8->V[chip8->inst.X] & 0xF]);
 
         } else if (chip8->inst.NN == 0xA1) {
             // 0xEX9E: Skip next instruction if key in VX is not pressed
             printf("Skip next instruction if key in V%X (0x%02X) is not "
                    "pressed; Keypad value: %d\n",
                    chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->keypad[chip8->V[chip8->inst.X]]);
+                   chip8->keypad[chip8->V[chip8->inst.X] & 0xF]);
         }
         break;
 
@@ -612,11 +1334,94 @@ void debug_info(chip8_t *chip8) {
 }
 #endif
 
-void emulate_instruct(chip8_t *chip8, config_t *config) {
+#ifdef COVERAGE
+// Returns the opcode pattern (e.g. "8XY4") an opcode belongs to
+const char *opcode_pattern(const uint16_t opcode) {
+    static const char *const patterns[16] = {
+        "0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+        "8XY?", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX??", "FX??",
+    };
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0)
+            return "00E0";
+        if (opcode == 0x00EE)
+            return "00EE";
+        break;
+    case 0x8: {
+        static const char *const alu[16] = {
+            "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7",
+            NULL,   NULL,   NULL,   NULL,   NULL,   NULL,   "8XYE", NULL,
+        };
+        if (alu[opcode & 0xF])
+            return alu[opcode & 0xF];
+        break;
+    }
+    case 0xE:
+        if ((opcode & 0xFF) == 0x9E)
+            return "EX9E";
+        if ((opcode & 0xFF) == 0xA1)
+            return "EXA1";
+        break;
+    case 0xF:
+        switch (opcode & 0xFF) {
+        case 0x07:
+            return "FX07";
+        case 0x0A:
+            return "FX0A";
+        case 0x15:
+            return "FX15";
+        case 0x18:
+            return "FX18";
+        case 0x1E:
+            return "FX1E";
+        case 0x29:
+            return "FX29";
+        case 0x33:
+            return "FX33";
+        case 0x55:
+            return "FX55";
+        case 0x65:
+            return "FX65";
+        default:
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+    return patterns[opcode >> 12];
+}
+#endif
+
+// Stores a byte to ram, first taking a private copy of the page if it is
+// shared with a clone
+void write_ram(chip8_t *chip8, const uint16_t addr, const uint8_t value) {
+    ram_page_t **page = &chip8->ram[(addr & 0xFFF) / RAM_PAGE_SIZE];
+    if (atomic_load_explicit(&(*page)->refs, memory_order_acquire) > 1) {
+        ram_page_t *copy = malloc(sizeof *copy);
+        if (!copy) {
+            chip8->faults |= FAULT_NO_MEMORY;
+            return;
+        }
+        atomic_init(&copy->refs, 1);
+        memcpy(copy->data, (*page)->data, sizeof copy->data);
+        if (atomic_fetch_sub_explicit(&(*page)->refs, 1,
+                                      memory_order_acq_rel) == 1)
+            free(*page); // The other users let go in the meantime
+        *page = copy;
+    }
+    (*page)->data[addr % RAM_PAGE_SIZE] = value;
+}
+
+void emulate_instruct(chip8_t *chip8, const config_t *config) {
 
-    // Grabbing opcode from ram
+    // Grabbing opcode from ram; addresses wrap at 4K like the 12 bit bus
+    chip8->PC &= 0xFFF;
     chip8->inst.opcode =
-        (chip8->ram[chip8->PC] << 8) | (chip8->ram[chip8->PC + 1]);
+        (RAM(chip8, chip8->PC) << 8) | RAM(chip8, chip8->PC + 1);
+    COVER(chip8, cov_exec, chip8->PC);
     chip8->PC += 2; // incrementing PC
 
     // TODO : remove instructio struct and move it inside function
@@ -641,7 +1446,13 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
             memset(&chip8->display[0], false, sizeof chip8->display);
         } else if (chip8->inst.NN == 0xEE) {
             // 0x00EE : Returns from a subroutine
-            chip8->PC = *--chip8->stack_ptr;
+            if (chip8->stack_ptr == &chip8->stack[0])
+                chip8->faults |= FAULT_STACK_UNDERFLOW; // Nothing to return to
+            else
+                chip8->PC = *--chip8->stack_ptr;
+        } else {
+            // 0x0NNN : Machine code routine, not supported
+            chip8->faults |= FAULT_BAD_OPCODE;
         }
 
         break;
@@ -653,6 +1464,11 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
 
     case 0x02:
         // 0x2NNN : Calls subroutine at NNN
+        if (chip8->stack_ptr == &chip8->stack[sizeof chip8->stack /
+                                              sizeof chip8->stack[0]]) {
+            chip8->faults |= FAULT_STACK_OVERFLOW; // Ignore the call
+            break;
+        }
         *chip8->stack_ptr++ = chip8->PC; // Storing current address and push ptr
         chip8->PC = chip8->inst.NNN;     // Jump to NNN
         break;
@@ -731,7 +1547,9 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
             // 0x8XY6 : Stores the least significant bit of VX in VF
             // and then shifts VX to the right by 1.
 
-            // TODO : Might have to do jank according to wiki note
+            //   SCHIP shifts VX in place, CHIP8 shifts VY into VX
+            if (chip8->quirks & QUIRK_SHIFT_VX)
+                chip8->inst.Y = chip8->inst.X;
             chip8->V[0xF] = chip8->V[chip8->inst.Y] & 1; // Use VY
             chip8->V[chip8->inst.X] =
                 chip8->V[chip8->inst.Y] >> 1; // Set VX = VY result
@@ -748,12 +1566,15 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
 
         case 0xE:
             // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
+            if (chip8->quirks & QUIRK_SHIFT_VX)
+                chip8->inst.Y = chip8->inst.X;
             chip8->V[0xF] = (chip8->V[chip8->inst.Y] & 0x80) >> 7; // Use VY
             chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y]
                                       << 1; // Set VX = VY result
 
             break;
         default:
+            chip8->faults |= FAULT_BAD_OPCODE;
             break;
         }
         break;
@@ -771,13 +1592,21 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
 
     case 0x0B:
         // 0xBNNN : Jumps to the address NNN plus V0.
-        chip8->PC = chip8->V[0x0] + chip8->inst.NNN;
+        //   SCHIP reads it as BXNN and adds VX instead
+        if (chip8->quirks & QUIRK_JUMP_VX)
+            chip8->PC = chip8->V[chip8->inst.X] + chip8->inst.NNN;
+        else
+            chip8->PC = chip8->V[0x0] + chip8->inst.NNN;
         break;
 
     case 0x0C:
         // 0xCXNN : Sets VX to the result of a bitwise and operation
         // on a random number (Typically: 0 to 255) and NN.
-        chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
+        // xorshift32 on the machine's own state
+        chip8->rng ^= chip8->rng << 13;
+        chip8->rng ^= chip8->rng >> 17;
+        chip8->rng ^= chip8->rng << 5;
+        chip8->V[chip8->inst.X] = (chip8->rng % 256) & chip8->inst.NN;
         break;
     case 0x0D:
         // 0xDXYN: Draw N-height sprite at coords X,Y; Read from
@@ -789,16 +1618,27 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
         uint8_t X_coord = chip8->V[chip8->inst.X] % config->window_width;
         uint8_t Y_coord = chip8->V[chip8->inst.Y] % config->window_height;
         const uint8_t orig_X = X_coord; // Original X value
+        const uint8_t orig_Y = Y_coord;
+        const bool clip = chip8->quirks & QUIRK_CLIP_SPRITES;
 
         chip8->V[0xF] = 0; // Initialize carry flag to 0
 
         // Loop over all N rows of the sprite
         for (uint8_t i = 0; i < chip8->inst.N; i++) {
+            // Stop at the bottom edge instead of wrapping
+            if (clip && orig_Y + i >= config->window_height)
+                break;
+
             // Get next byte/row of sprite data
-            const uint8_t sprite_data = chip8->ram[chip8->I + i];
+            const uint8_t sprite_data = RAM(chip8, chip8->I + i);
+            COVER(chip8, cov_read, chip8->I + i);
             X_coord = orig_X; // Reset X for the next row to draw
 
             for (int8_t j = 7; j >= 0; j--) {
+                // Stop at the right edge instead of wrapping
+                if (clip && (uint32_t)(orig_X + 7 - j) >= config->window_width)
+                    break;
+
                 // If sprite pixel/bit is on and display pixel is
                 // on, set carry flag
                 bool *pixel =
@@ -826,15 +1666,17 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
         if (chip8->inst.NN == 0x9E) {
             // 0xEX9E : Skips the next instruction if the key stored
             // in VX is pressed
-            if (chip8->keypad[chip8->inst.X]) {
+            if (chip8->keypad[chip8->V[chip8->inst.X] & 0xF]) {
                 chip8->PC += 2;
             }
 
         } else if (chip8->inst.NN == 0xA1) {
             // 0xEXA1 : Skips the next instruction if the key stored
             // in VX is not pressed
-            if (!chip8->keypad[chip8->V[chip8->inst.X]])
+            if (!chip8->keypad[chip8->V[chip8->inst.X] & 0xF])
                 chip8->PC += 2;
+        } else {
+            chip8->faults |= FAULT_BAD_OPCODE;
         }
 
         break;
@@ -842,30 +1684,28 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
         switch (chip8->inst.NN) {
         case 0x0A: {
             // 0xFX0A: VX = get_key(); Await until a keypress, and store in VX
-            static bool any_key_pressed = false;
-            static uint8_t key = 0xFF;
-
-            for (uint8_t i = 0; key == 0xFF && i < sizeof chip8->keypad; i++)
+            for (uint8_t i = 0;
+                 !chip8->any_key_pressed && i < sizeof chip8->keypad; i++)
                 if (chip8->keypad[i]) {
-                    key = i; // Save pressed key to check until it is released
-                    any_key_pressed = true;
+                    chip8->key = i; // Save pressed key to check until it is
+                                    // released
+                    chip8->any_key_pressed = true;
                     break;
                 }
 
             // If no key has been pressed yet, keep getting the current opcode &
             // running this instruction
-            if (!any_key_pressed)
+            if (!chip8->any_key_pressed)
                 chip8->PC -= 2;
             else {
                 // A key has been pressed, also wait until it is released to set
                 // the key in VX
-                if (chip8->keypad[key]) // "Busy loop" CHIP8 emulation until key
-                                        // is released
+                if (chip8->keypad[chip8->key]) // "Busy loop" CHIP8 emulation
+                                               // until key is released
                     chip8->PC -= 2;
                 else {
-                    chip8->V[chip8->inst.X] = key; // VX = key
-                    key = 0xFF;                    // Reset key to not found
-                    any_key_pressed = false; // Reset to nothing pressed yet
+                    chip8->V[chip8->inst.X] = chip8->key; // VX = key
+                    chip8->any_key_pressed = false; // Reset to nothing pressed
                 }
             }
             break;
@@ -902,11 +1742,14 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
             // 0xFX33: Store BCD representation of VX at memory offset from I;
             //   I = hundred's place, I+1 = ten's place, I+2 = one's place
             uint8_t bcd = chip8->V[chip8->inst.X];
-            chip8->ram[chip8->I + 2] = bcd % 10;
+            write_ram(chip8, chip8->I + 2, bcd % 10);
             bcd /= 10;
-            chip8->ram[chip8->I + 1] = bcd % 10;
+            write_ram(chip8, chip8->I + 1, bcd % 10);
             bcd /= 10;
-            chip8->ram[chip8->I] = bcd;
+            write_ram(chip8, chip8->I, bcd);
+            COVER(chip8, cov_write, chip8->I);
+            COVER(chip8, cov_write, chip8->I + 1);
+            COVER(chip8, cov_write, chip8->I + 2);
             break;
         }
 
@@ -914,32 +1757,101 @@ void emulate_instruct(chip8_t *chip8, config_t *config) {
             // 0xFX55: Register dump V0-VX inclusive to memory offset from I;
             //   SCHIP does not increment I, CHIP8 does increment I
             for (uint8_t i = 0; i <= chip8->inst.X; i++) {
-                chip8->ram[chip8->I++] = chip8->V[i]; // Increment I each time
+                COVER(chip8, cov_write, chip8->I + i);
+                write_ram(chip8, chip8->I + i, chip8->V[i]);
             }
+            if (!(chip8->quirks & QUIRK_KEEP_I))
+                chip8->I += chip8->inst.X + 1; // Increment I
             break;
 
         case 0x65:
             // 0xFX65: Register load V0-VX inclusive from memory offset from I;
             //   SCHIP does not increment I, CHIP8 does increment I
             for (uint8_t i = 0; i <= chip8->inst.X; i++) {
-                chip8->V[i] = chip8->ram[chip8->I++]; // Increment I each time
+                COVER(chip8, cov_read, chip8->I + i);
+                chip8->V[i] = RAM(chip8, chip8->I + i);
             }
+            if (!(chip8->quirks & QUIRK_KEEP_I))
+                chip8->I += chip8->inst.X + 1; // Increment I
             break;
 
         default:
+            chip8->faults |= FAULT_BAD_OPCODE;
             break;
         }
         break;
     }
 }
 
-void update_screen(const sdl_t *sdl, const config_t *config, chip8_t *chip8) {
-    SDL_Rect rect = {.x = 0, .y = 0, .w = config->scaler, .h = config->scaler};
+// Packs the display into 1 bit per pixel, MSB first, row major
+void pack_display(const chip8_t *chip8, uint8_t packed[]) {
+    for (uint32_t i = 0; i < sizeof chip8->display / 8; i++) {
+        const bool *px = &chip8->display[i * 8];
+        packed[i] = px[0] << 7 | px[1] << 6 | px[2] << 5 | px[3] << 4 |
+                    px[4] << 3 | px[5] << 2 | px[6] << 1 | px[7];
+    }
+}
 
-    // Getting Background and Foreground colours
-    const uint8_t bg_r = (config->bg_colour >> 24) & 0xFF;
-    const uint8_t fg_r = (config->fg_colour >> 24) & 0xFF;
-    const uint8_t bg_g = (config->bg_colour >> 16) & 0xFF;
+// Publishes the current frame to shared memory and picks up injected keys
+void update_shm(shm_t *shm, chip8_t *chip8) {
+    if (!shm->frame)
+        return;
+
+    shm_frame_t *frame = shm->frame;
+
+    // Seqlock write: odd sequence marks the display as being written
+    const uint32_t seq =
+        atomic_load_explicit(&frame->seq, memory_order_relaxed);
+    atomic_store_explicit(&frame->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    pack_display(chip8, frame->display);
+    atomic_fetch_add_explicit(&frame->frame, 1, memory_order_relaxed);
+
+    atomic_store_explicit(&frame->seq, seq + 2, memory_order_release);
+
+    // Only apply keys whose injected state changed, so the local keyboard
+    // still works for keys the external process is not touching
+    const uint16_t keys =
+        atomic_load_explicit(&frame->keypad_inject, memory_order_acquire);
+    const uint16_t changed = keys ^ shm->keys;
+    for (uint8_t i = 0; i < sizeof chip8->keypad; i++) {
+        if (changed & (1u << i))
+            chip8->keypad[i] = keys & (1u << i);
+    }
+    shm->keys = keys;
+}
+
+// Queues the current frame for the recorder; never blocks the emulator
+void update_recorder(recorder_t *rec, const chip8_t *chip8) {
+    if (!rec->file)
+        return;
+
+    const uint32_t head =
+        atomic_load_explicit(&rec->head, memory_order_relaxed);
+    const uint32_t tail =
+        atomic_load_explicit(&rec->tail, memory_order_acquire);
+
+    if (head - tail == RECORD_SLOTS) {
+        // Worker is behind; drop this frame rather than stall emulation
+        rec->dropped++;
+        return;
+    }
+
+    record_slot_t *slot = &rec->slots[head % RECORD_SLOTS];
+    pack_display(chip8, slot->display);
+    slot->dropped = rec->dropped;
+    rec->dropped = 0;
+    atomic_store_explicit(&rec->head, head + 1, memory_order_release);
+}
+
+void update_screen(const sdl_t *sdl, const config_t *config, chip8_t *chip8) {
+    SDL_Rect rect = {.x = 0, .y = 0, .w = config->scaler, .h = config->scaler};
+
+    // Getting Background and Foreground colours
+    const uint8_t bg_r = (config->bg_colour >> 24) & 0xFF;
+    const uint8_t fg_r = (config->fg_colour >> 24) & 0xFF;
+    const uint8_t bg_g = (config->bg_colour >> 16) & 0xFF;
     const uint8_t fg_g = (config->fg_colour >> 16) & 0xFF;
     const uint8_t bg_b = (config->bg_colour >> 8) & 0xFF;
     const uint8_t fg_b = (config->fg_colour >> 8) & 0xFF;
@@ -968,7 +1880,97 @@ void update_screen(const sdl_t *sdl, const config_t *config, chip8_t *chip8) {
             SDL_RenderFillRect(sdl->rend, &rect);
         }
     }
-    SDL_RenderPresent(sdl->rend);
+}
+
+// Draws text in a 3x5 pixel font, each font pixel size x size
+void draw_text(const sdl_t *sdl, int x, const int y, const int size,
+               const char *text) {
+    static const char charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ./%:-";
+    static const uint8_t glyphs[][5] = {
+        {0xE0, 0xA0, 0xA0, 0xA0, 0xE0}, // 0
+        {0x40, 0xC0, 0x40, 0x40, 0xE0}, // 1
+        {0xE0, 0x20, 0xE0, 0x80, 0xE0}, // 2
+        {0xE0, 0x20, 0xE0, 0x20, 0xE0}, // 3
+        {0xA0, 0xA0, 0xE0, 0x20, 0x20}, // 4
+        {0xE0, 0x80, 0xE0, 0x20, 0xE0}, // 5
+        {0xE0, 0x80, 0xE0, 0xA0, 0xE0}, // 6
+        {0xE0, 0x20, 0x20, 0x40, 0x40}, // 7
+        {0xE0, 0xA0, 0xE0, 0xA0, 0xE0}, // 8
+        {0xE0, 0xA0, 0xE0, 0x20, 0xE0}, // 9
+        {0x40, 0xA0, 0xE0, 0xA0, 0xA0}, // A
+        {0xC0, 0xA0, 0xC0, 0xA0, 0xC0}, // B
+        {0x60, 0x80, 0x80, 0x80, 0x60}, // C
+        {0xC0, 0xA0, 0xA0, 0xA0, 0xC0}, // D
+        {0xE0, 0x80, 0xC0, 0x80, 0xE0}, // E
+        {0xE0, 0x80, 0xC0, 0x80, 0x80}, // F
+        {0x60, 0x80, 0xA0, 0xA0, 0x60}, // G
+        {0xA0, 0xA0, 0xE0, 0xA0, 0xA0}, // H
+        {0xE0, 0x40, 0x40, 0x40, 0xE0}, // I
+        {0x20, 0x20, 0x20, 0xA0, 0x40}, // J
+        {0xA0, 0xA0, 0xC0, 0xA0, 0xA0}, // K
+        {0x80, 0x80, 0x80, 0x80, 0xE0}, // L
+        {0xA0, 0xE0, 0xE0, 0xA0, 0xA0}, // M
+        {0xC0, 0xA0, 0xA0, 0xA0, 0xA0}, // N
+        {0x40, 0xA0, 0xA0, 0xA0, 0x40}, // O
+        {0xC0, 0xA0, 0xC0, 0x80, 0x80}, // P
+        {0x40, 0xA0, 0xA0, 0xC0, 0x60}, // Q
+        {0xC0, 0xA0, 0xC0, 0xA0, 0xA0}, // R
+        {0x60, 0x80, 0x40, 0x20, 0xC0}, // S
+        {0xE0, 0x40, 0x40, 0x40, 0x40}, // T
+        {0xA0, 0xA0, 0xA0, 0xA0, 0xE0}, // U
+        {0xA0, 0xA0, 0xA0, 0xA0, 0x40}, // V
+        {0xA0, 0xA0, 0xE0, 0xE0, 0xA0}, // W
+        {0xA0, 0xA0, 0x40, 0xA0, 0xA0}, // X
+        {0xA0, 0xA0, 0x40, 0x40, 0x40}, // Y
+        {0xE0, 0x20, 0x40, 0x80, 0xE0}, // Z
+        {0x00, 0x00, 0x00, 0x00, 0x40}, // .
+        {0x20, 0x20, 0x40, 0x80, 0x80}, // /
+        {0xA0, 0x20, 0x40, 0x80, 0xA0}, // %
+        {0x00, 0x40, 0x00, 0x40, 0x00}, // :
+        {0x00, 0x00, 0xE0, 0x00, 0x00}, // -
+    };
+
+    for (; *text; text++, x += 4 * size) {
+        const char *c = strchr(charset, *text);
+        if (!c || !*c)
+            continue; // Space or unknown character
+
+        const uint8_t *glyph = glyphs[c - charset];
+        for (int row = 0; row < 5; row++) {
+            for (int col = 0; col < 3; col++) {
+                if (!(glyph[row] & (0x80 >> col)))
+                    continue;
+                const SDL_Rect px = {x + col * size, y + row * size, size,
+                                     size};
+                SDL_RenderFillRect(sdl->rend, &px);
+            }
+        }
+    }
+}
+
+// Draws the performance overlay from the last complete stats window
+void draw_hud(const sdl_t *sdl, const config_t *config, const stats_t *stats) {
+    const int size = config->scaler / 5 ? config->scaler / 5 : 1;
+    const int line = 7 * size;
+    char text[7][32];
+
+    snprintf(text[0], sizeof text[0], "IPS %.0f/%u", stats->ips,
+             config->clk_speed);
+    snprintf(text[1], sizeof text[1], "EMU %.2fMS", stats->emu_ms);
+    snprintf(text[2], sizeof text[2], "RENDER %.2fMS", stats->render_ms);
+    snprintf(text[3], sizeof text[3], "PRESENT %.2fMS", stats->present_ms);
+    snprintf(text[4], sizeof text[4], "SLEEP %.2fMS", stats->sleep_ms);
+    snprintf(text[5], sizeof text[5], "DROPPED %u", stats->dropped);
+    snprintf(text[6], sizeof text[6], "CPU %.0f%%", stats->cpu_percent);
+
+    const SDL_Rect back = {0, 0, 16 * 4 * size + 2 * size,
+                           7 * line + size};
+    SDL_SetRenderDrawColor(sdl->rend, 0x00, 0x00, 0x00, 0xFF);
+    SDL_RenderFillRect(sdl->rend, &back);
+
+    SDL_SetRenderDrawColor(sdl->rend, 0xFF, 0xFF, 0x00, 0xFF);
+    for (int i = 0; i < 7; i++)
+        draw_text(sdl, 2 * size, size + i * line, size, text[i]);
 }
 
 // Function for updating delay and sound timer
@@ -980,6 +1982,662 @@ void update_timers(chip8_t *chip8) {
         chip8->delay_timer--;
 }
 
+// COSMAC VIP timing (see --vip). Costs are approximate VIP machine cycles
+// (8 clocks of the 1.76MHz CDP1802) per instruction, on top of the
+// interpreter's fetch/decode, plus cycles per sprite row (DXYN) or register
+// (FX55/FX65). Of the 3668 cycles in a 60Hz frame about 1100 go to display
+// DMA and the interrupt routine.
+#define VIP_FRAME_CYCLES 2572
+#define VIP_FETCH_CYCLES 40
+
+typedef struct {
+    uint16_t base; // Cycles for the instruction
+    uint16_t unit; // Extra cycles per sprite row / register
+} vip_cost_t;
+
+// Indexed by the opcode's first nibble; 0xF instructions use vip_f_costs
+static const vip_cost_t vip_costs[16] = {
+    [0x0] = {24, 0}, [0x1] = {12, 0}, [0x2] = {26, 0},  [0x3] = {10, 0},
+    [0x4] = {10, 0}, [0x5] = {14, 0}, [0x6] = {6, 0},   [0x7] = {10, 0},
+    [0x8] = {44, 0}, [0x9] = {14, 0}, [0xA] = {12, 0},  [0xB] = {22, 0},
+    [0xC] = {36, 0}, [0xD] = {170, 45}, [0xE] = {14, 0},
+};
+
+// Indexed by NN of 0xFXNN instructions
+static const vip_cost_t vip_f_costs[256] = {
+    [0x07] = {10, 0}, [0x0A] = {20, 0}, [0x15] = {10, 0}, [0x18] = {10, 0},
+    [0x1E] = {16, 0}, [0x29] = {16, 0}, [0x33] = {84, 0}, [0x55] = {14, 14},
+    [0x65] = {14, 14},
+};
+
+// Cycles the opcode takes on a COSMAC VIP
+uint32_t vip_cost(const uint16_t opcode) {
+    const vip_cost_t *cost = opcode >> 12 == 0xF ? &vip_f_costs[opcode & 0xFF]
+                                                 : &vip_costs[opcode >> 12];
+    // Sprite rows for DXYN, registers for FX55/FX65, unit is 0 elsewhere
+    const uint32_t units = opcode >> 12 == 0xD ? opcode & 0xF
+                                                : ((opcode >> 8) & 0xF) + 1;
+    return VIP_FETCH_CYCLES + cost->base + cost->unit * units;
+}
+
+// Writes the assembly form of an opcode into buf
+void disassemble(const uint16_t opcode, char *buf, const size_t size) {
+    const uint16_t NNN = opcode & 0x0FFF;
+    const uint8_t NN = opcode & 0x00FF;
+    const uint8_t N = opcode & 0x000F;
+    const uint8_t X = (opcode >> 8) & 0x0F;
+    const uint8_t Y = (opcode >> 4) & 0x0F;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0)
+            snprintf(buf, size, "CLS");
+        else if (opcode == 0x00EE)
+            snprintf(buf, size, "RET");
+        else
+            snprintf(buf, size, "SYS  0x%03X", NNN);
+        return;
+    case 0x1:
+        snprintf(buf, size, "JP   0x%03X", NNN);
+        return;
+    case 0x2:
+        snprintf(buf, size, "CALL 0x%03X", NNN);
+        return;
+    case 0x3:
+        snprintf(buf, size, "SE   V%X, 0x%02X", X, NN);
+        return;
+    case 0x4:
+        snprintf(buf, size, "SNE  V%X, 0x%02X", X, NN);
+        return;
+    case 0x5:
+        snprintf(buf, size, "SE   V%X, V%X", X, Y);
+        return;
+    case 0x6:
+        snprintf(buf, size, "LD   V%X, 0x%02X", X, NN);
+        return;
+    case 0x7:
+        snprintf(buf, size, "ADD  V%X, 0x%02X", X, NN);
+        return;
+    case 0x8: {
+        static const char *const alu[16] = {
+            "LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+            NULL, NULL, NULL,  NULL,  NULL,  NULL,  "SHL", NULL,
+        };
+        if (alu[N])
+            snprintf(buf, size, "%-4s V%X, V%X", alu[N], X, Y);
+        else
+            snprintf(buf, size, "DW   0x%04X", opcode);
+        return;
+    }
+    case 0x9:
+        snprintf(buf, size, "SNE  V%X, V%X", X, Y);
+        return;
+    case 0xA:
+        snprintf(buf, size, "LD   I, 0x%03X", NNN);
+        return;
+    case 0xB:
+        snprintf(buf, size, "JP   V0, 0x%03X", NNN);
+        return;
+    case 0xC:
+        snprintf(buf, size, "RND  V%X, 0x%02X", X, NN);
+        return;
+    case 0xD:
+        snprintf(buf, size, "DRW  V%X, V%X, %u", X, Y, N);
+        return;
+    case 0xE:
+        if (NN == 0x9E)
+            snprintf(buf, size, "SKP  V%X", X);
+        else if (NN == 0xA1)
+            snprintf(buf, size, "SKNP V%X", X);
+        else
+            snprintf(buf, size, "DW   0x%04X", opcode);
+        return;
+    default:
+        switch (NN) {
+        case 0x07:
+            snprintf(buf, size, "LD   V%X, DT", X);
+            return;
+        case 0x0A:
+            snprintf(buf, size, "LD   V%X, K", X);
+            return;
+        case 0x15:
+            snprintf(buf, size, "LD   DT, V%X", X);
+            return;
+        case 0x18:
+            snprintf(buf, size, "LD   ST, V%X", X);
+            return;
+        case 0x1E:
+            snprintf(buf, size, "ADD  I, V%X", X);
+            return;
+        case 0x29:
+            snprintf(buf, size, "LD   F, V%X", X);
+            return;
+        case 0x33:
+            snprintf(buf, size, "LD   B, V%X", X);
+            return;
+        case 0x55:
+            snprintf(buf, size, "LD   [I], V%X", X);
+            return;
+        case 0x65:
+            snprintf(buf, size, "LD   V%X, [I]", X);
+            return;
+        default:
+            snprintf(buf, size, "DW   0x%04X", opcode);
+            return;
+        }
+    }
+}
+
+// True when the debugger has anything to check; otherwise the plain
+// emulate_frame() path is used and the debugger costs nothing
+bool debugger_active(const debugger_t *dbg) {
+    return dbg->steps || dbg->step_over >= 0 || dbg->n_breaks ||
+           dbg->n_watches;
+}
+
+// Prints count disassembled instructions starting at addr
+void debugger_list(const chip8_t *chip8, uint16_t addr, uint32_t count) {
+    for (uint32_t i = 0; i < count && addr < RAM_SIZE - 1; i++) {
+        char text[32];
+        const uint16_t opcode = RAM(chip8, addr) << 8 | RAM(chip8, addr + 1);
+        disassemble(opcode, text, sizeof text);
+        printf("%s 0x%03X: %04X  %s\n", addr == chip8->PC ? "=>" : "  ", addr,
+               opcode, text);
+        addr += 2;
+    }
+}
+
+// Prints registers, timers and the subroutine stack
+void debugger_regs(const chip8_t *chip8) {
+    for (uint8_t i = 0; i < sizeof chip8->V; i++)
+        printf("V%X=%02X%s", i, chip8->V[i], i % 8 == 7 ? "\n" : " ");
+    printf("I=%03X PC=%03X DT=%02X ST=%02X\n", chip8->I, chip8->PC,
+           chip8->delay_timer, chip8->sound_timer);
+}
+
+void debugger_stack(const chip8_t *chip8) {
+    const uint32_t depth = chip8->stack_ptr - chip8->stack;
+    if (!depth)
+        puts("Stack empty");
+    for (uint32_t i = depth; i > 0; i--)
+        printf("#%u return to 0x%03X\n", depth - i, chip8->stack[i - 1]);
+}
+
+void debugger_help(void) {
+    puts("c               continue\n"
+         "s [n]           step n instructions\n"
+         "n               step over a CALL\n"
+         "b ADDR [R OP V] break at ADDR, optionally only when register R\n"
+         "                (V0-VF or I) OP (== != < >) value V,\n"
+         "                e.g. b 2A0 V3 == 5\n"
+         "w ADDR          break after an instruction changes ram[ADDR]\n"
+         "d [N]           delete breakpoint/watchpoint N, or all\n"
+         "i               list breakpoints and watchpoints\n"
+         "r               registers\n"
+         "bt              subroutine stack\n"
+         "x ADDR [LEN]    dump memory\n"
+         "l [ADDR] [N]    disassemble\n"
+         "q               quit emulator");
+}
+
+// Parses "b ADDR [R OP V]" arguments into a breakpoint
+bool debugger_parse_break(const char *args, breakpoint_t *bp) {
+    char reg[4] = "", op[3] = "";
+    unsigned addr, value = 0;
+    const int n = sscanf(args, "%x %3s %2s %x", &addr, reg, op, &value);
+    if (n < 1 || addr >= 4096)
+        return false;
+
+    *bp = (breakpoint_t){.addr = addr, .reg = COND_NONE};
+    if (n == 1)
+        return true;
+    if (n != 4)
+        return false;
+
+    if (toupper((unsigned char)reg[0]) == 'I' && !reg[1])
+        bp->reg = COND_I;
+    else if (toupper((unsigned char)reg[0]) == 'V' && isxdigit(reg[1]) &&
+             !reg[2])
+        bp->reg = strtol(&reg[1], NULL, 16);
+    else
+        return false;
+
+    if (strcmp(op, "==") == 0 || strcmp(op, "!=") == 0 ||
+        strcmp(op, "<") == 0 || strcmp(op, ">") == 0)
+        bp->op = op[0];
+    else
+        return false;
+
+    bp->value = value;
+    return true;
+}
+
+// Reads and runs commands from the terminal until execution should resume.
+// Leaves chip8->state as QUIT if the user quits.
+void debugger_prompt(debugger_t *dbg, chip8_t *chip8) {
+    char line[128];
+    dbg->steps = 0;
+    dbg->step_over = -1;
+
+    debugger_list(chip8, chip8->PC, 1);
+    for (;;) {
+        printf("(chip8) ");
+        fflush(stdout);
+        if (!fgets(line, sizeof line, stdin)) {
+            chip8->state = QUIT; // stdin closed
+            return;
+        }
+
+        char cmd[8] = "";
+        int used = 0;
+        sscanf(line, "%7s %n", cmd, &used);
+        const char *args = line + used;
+        unsigned a = 0, b = 0;
+
+        if (!cmd[0] || strcmp(cmd, "s") == 0) {
+            // Step; an empty line repeats a single step
+            dbg->steps = sscanf(args, "%u", &a) == 1 && a > 1 ? a : 1;
+            return;
+        } else if (strcmp(cmd, "c") == 0) {
+            return;
+        } else if (strcmp(cmd, "n") == 0) {
+            // Step over: run a CALL until it returns to the next instruction
+            if ((RAM(chip8, chip8->PC) >> 4) == 0x2)
+                dbg->step_over = chip8->PC + 2;
+            else
+                dbg->steps = 1;
+            return;
+        } else if (strcmp(cmd, "b") == 0) {
+            breakpoint_t bp;
+            if (dbg->n_breaks == MAX_BREAKPOINTS)
+                puts("Too many breakpoints");
+            else if (!debugger_parse_break(args, &bp))
+                puts("Usage: b ADDR [V0-VF|I ==|!=|<|> VALUE]");
+            else
+                dbg->breaks[dbg->n_breaks++] = bp;
+        } else if (strcmp(cmd, "w") == 0) {
+            if (dbg->n_watches == MAX_WATCHPOINTS)
+                puts("Too many watchpoints");
+            else if (sscanf(args, "%x", &a) != 1 || a >= 4096)
+                puts("Usage: w ADDR");
+            else
+                dbg->watches[dbg->n_watches++] =
+                    (watchpoint_t){.addr = a, .last = RAM(chip8, a)};
+        } else if (strcmp(cmd, "d") == 0) {
+            // Breakpoints are numbered first, then watchpoints
+            if (sscanf(args, "%u", &a) != 1) {
+                dbg->n_breaks = dbg->n_watches = 0;
+            } else if (a < dbg->n_breaks) {
+                dbg->breaks[a] = dbg->breaks[--dbg->n_breaks];
+            } else if (a - dbg->n_breaks < dbg->n_watches) {
+                a -= dbg->n_breaks;
+                dbg->watches[a] = dbg->watches[--dbg->n_watches];
+            } else {
+                puts("No such breakpoint");
+            }
+        } else if (strcmp(cmd, "i") == 0) {
+            uint32_t n = 0;
+            for (uint32_t i = 0; i < dbg->n_breaks; i++, n++) {
+                const breakpoint_t *bp = &dbg->breaks[i];
+                printf("%u: break 0x%03X", n, bp->addr);
+                if (bp->reg == COND_I)
+                    printf(" if I %c%s 0x%X", bp->op,
+                           bp->op == '=' || bp->op == '!' ? "=" : "",
+                           bp->value);
+                else if (bp->reg != COND_NONE)
+                    printf(" if V%X %c%s 0x%X", bp->reg, bp->op,
+                           bp->op == '=' || bp->op == '!' ? "=" : "",
+                           bp->value);
+                putchar('\n');
+            }
+            for (uint32_t i = 0; i < dbg->n_watches; i++, n++)
+                printf("%u: watch 0x%03X\n", n, dbg->watches[i].addr);
+        } else if (strcmp(cmd, "r") == 0) {
+            debugger_regs(chip8);
+        } else if (strcmp(cmd, "bt") == 0) {
+            debugger_stack(chip8);
+        } else if (strcmp(cmd, "x") == 0) {
+            const int n = sscanf(args, "%x %u", &a, &b);
+            if (n < 1 || a >= 4096) {
+                puts("Usage: x ADDR [LEN]");
+                continue;
+            }
+            b = n == 2 ? b : 16;
+            for (uint32_t i = 0; i < b && a + i < RAM_SIZE; i++)
+                printf("%s%02X", i % 16 ? " " : i ? "\n" : "",
+                       RAM(chip8, a + i));
+            putchar('\n');
+        } else if (strcmp(cmd, "l") == 0) {
+            const int n = sscanf(args, "%x %u", &a, &b);
+            debugger_list(chip8, n >= 1 ? a & 0xFFF : chip8->PC,
+                          n == 2 ? b : 10);
+        } else if (strcmp(cmd, "q") == 0) {
+            chip8->state = QUIT;
+            return;
+        } else {
+            debugger_help();
+        }
+    }
+}
+
+// True if the debugger should stop before the instruction at PC
+bool debugger_should_break(debugger_t *dbg, const chip8_t *chip8) {
+    if ((dbg->steps && --dbg->steps == 0) || dbg->step_over == chip8->PC)
+        return true;
+
+    for (uint32_t i = 0; i < dbg->n_breaks; i++) {
+        const breakpoint_t *bp = &dbg->breaks[i];
+        if (bp->addr != chip8->PC)
+            continue;
+        if (bp->reg == COND_NONE)
+            return true;
+
+        const uint16_t value = bp->reg == COND_I ? chip8->I : chip8->V[bp->reg];
+        if ((bp->op == '=' && value == bp->value) ||
+            (bp->op == '!' && value != bp->value) ||
+            (bp->op == '<' && value < bp->value) ||
+            (bp->op == '>' && value > bp->value))
+            return true;
+    }
+    return false;
+}
+
+// Debugger version of emulate_frame(); checks breakpoints before and
+// watchpoints after every instruction. Returns instructions run.
+uint32_t debugger_frame(debugger_t *dbg, chip8_t *chip8,
+                        const config_t *config) {
+    uint32_t count = 0;
+    if (chip8->vip_timing)
+        chip8->cycle_budget += VIP_FRAME_CYCLES;
+
+    while (chip8->vip_timing ? chip8->cycle_budget > 0
+                              : count < config->clk_speed / 60) {
+        if (debugger_should_break(dbg, chip8)) {
+            debugger_prompt(dbg, chip8);
+            if (chip8->state == QUIT)
+                return count;
+        }
+
+        emulate_instruct(chip8, config);
+        count++;
+
+        if (chip8->vip_timing) {
+            chip8->cycle_budget -= vip_cost(chip8->inst.opcode);
+            if (chip8->inst.opcode >> 12 == 0xD && chip8->cycle_budget > 0)
+                chip8->cycle_budget = 0; // Display wait, as in emulate_frame
+        }
+
+        for (uint32_t w = 0; w < dbg->n_watches; w++) {
+            watchpoint_t *watch = &dbg->watches[w];
+            if (RAM(chip8, watch->addr) == watch->last)
+                continue;
+            printf("Watchpoint 0x%03X: 0x%02X -> 0x%02X\n", watch->addr,
+                   watch->last, RAM(chip8, watch->addr));
+            watch->last = RAM(chip8, watch->addr);
+            dbg->steps = 1; // Stop before the next instruction
+        }
+    }
+    return count;
+}
+
+// Runs one 60Hz frame worth of instructions without touching SDL, applying
+// queued input (may be NULL) at its place in the frame. Returns the number
+// of instructions run.
+uint32_t emulate_frame(chip8_t *chip8, const config_t *config,
+                       input_queue_t *input) {
+    const uint32_t n_events = input ? input->count : 0;
+    uint32_t e = 0;
+
+    if (!chip8->vip_timing) {
+        // Run the batch in plain stretches between key changes
+        const uint32_t n = config->clk_speed / 60;
+        uint32_t i = 0;
+        for (; e < n_events; e++) {
+            const uint32_t at = (uint64_t)input->events[e].at * n >> 16;
+            for (; i < at; i++)
+                emulate_instruct(chip8, config);
+            chip8->keypad[input->events[e].key] = input->events[e].down;
+        }
+        for (; i < n; i++) {
+            emulate_instruct(chip8, config);
+        }
+        if (input)
+            input->count = 0;
+        return n;
+    }
+
+    // COSMAC VIP timing: spend a frame's worth of cycles. Overshoot is paid
+    // back next frame. Key changes land once the frame has spent as many
+    // cycles as had passed when they happened.
+    uint32_t count = 0;
+    chip8->cycle_budget += VIP_FRAME_CYCLES;
+    const int32_t start = chip8->cycle_budget;
+#define KEY_BUDGET(e)                                                          \
+    ((e) < n_events ? start - (input->events[e].at * VIP_FRAME_CYCLES >> 16)  \
+                    : INT32_MIN)
+    int32_t key_budget = KEY_BUDGET(e); // Budget left when the next key lands
+    while (chip8->cycle_budget > 0) {
+        while (chip8->cycle_budget <= key_budget) {
+            chip8->keypad[input->events[e].key] = input->events[e].down;
+            e++;
+            key_budget = KEY_BUDGET(e);
+        }
+
+        emulate_instruct(chip8, config);
+        count++;
+        chip8->cycle_budget -= vip_cost(chip8->inst.opcode);
+
+        // Display wait: the VIP draws sprites in step with the display
+        // interrupt, so nothing more runs this frame after a DXYN
+        if (chip8->inst.opcode >> 12 == 0xD) {
+            if (chip8->cycle_budget > 0)
+                chip8->cycle_budget = 0;
+            break;
+        }
+    }
+#undef KEY_BUDGET
+    flush_input(chip8, input); // Anything after the display wait
+    return count;
+}
+
+// Makes dst a copy of src that shares its ram pages until either writes to
+// them; registers and display are copied. dst must be zeroed or a machine
+// whose pages can be released. The stack pointer is rebased onto dst's own
+// stack.
+void clone_chip8(chip8_t *dst, const chip8_t *src) {
+    for (uint32_t i = 0; i < RAM_PAGES; i++)
+        atomic_fetch_add_explicit(&src->ram[i]->refs, 1,
+                                  memory_order_relaxed);
+    cleanup_chip8(dst);
+    *dst = *src;
+    dst->stack_ptr = dst->stack + (src->stack_ptr - src->stack);
+}
+
+// Reloads the ROM in place if its file changed since the last call. The
+// machine is reset but keeps its run state and held keys; SDL is untouched.
+void update_rom_watch(rom_watch_t *watch, chip8_t *chip8) {
+    if (watch->fd < 0)
+        return;
+
+    // Drain all pending events; several writes count as one reload
+    bool changed = false;
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(watch->fd, buf, sizeof buf)) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len && strcmp(event->name, watch->file) == 0)
+                changed = true;
+            p += sizeof *event + event->len;
+        }
+    }
+    if (!changed)
+        return;
+
+    // Load into a fresh machine first so a bad or half written file leaves
+    // the running ROM alone
+    chip8_t *fresh = calloc(1, sizeof *fresh);
+    if (!fresh)
+        return;
+
+    if (init_chip8(fresh, chip8->rom_name)) {
+        fresh->state = chip8->state;
+        fresh->rng = chip8->rng;
+        fresh->quirks = chip8->quirks;
+        fresh->vip_timing = chip8->vip_timing;
+        memcpy(fresh->keypad, chip8->keypad, sizeof fresh->keypad);
+        clone_chip8(chip8, fresh);
+        printf("==== RELOADED %s ====\n", chip8->rom_name);
+    }
+    cleanup_chip8(fresh);
+    free(fresh);
+}
+
+// 64 bit FNV-1a hash of a ROM image or display; never 0, which marks empty
+// catalog slots
+uint64_t hash_bytes(const uint8_t data[], const size_t size) {
+    uint64_t hash = 0xCBF29CE484222325u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3u;
+    }
+    return hash ? hash : 1;
+}
+
+// Looks a ROM up in the catalog by its hash, NULL if it is not listed
+const catalog_entry_t *find_rom(const catalog_t *catalog, const uint64_t hash) {
+    if (!catalog->map)
+        return NULL;
+
+    // Linear probing; an empty slot ends the search, and a damaged file
+    // without one is searched only once round
+    const uint32_t mask = catalog->map->n_slots - 1;
+    for (uint32_t n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+        const catalog_entry_t *entry = &catalog->map->entries[i];
+        if (entry->hash == hash)
+            return entry;
+        if (!entry->hash)
+            return NULL;
+    }
+    return NULL;
+}
+
+// Applies the catalog settings of the loaded ROM, unless the command line
+// already chose them
+void apply_rom_settings(config_t *config, const catalog_t *catalog,
+                        const chip8_t *chip8) {
+    uint8_t rom[CATALOG_MAX_ROM];
+    for (uint16_t i = 0; i < chip8->rom_size; i++)
+        rom[i] = RAM(chip8, 0x200 + i);
+    const catalog_entry_t *entry =
+        find_rom(catalog, hash_bytes(rom, chip8->rom_size));
+    if (!entry)
+        return;
+
+    if (entry->clk_speed)
+        config->clk_speed = entry->clk_speed;
+    if (!config->quirks_set) {
+        config->quirks = entry->quirks & QUIRK_ALL;
+        config->quirks_set = true; // Known ROM; nothing to detect
+    }
+    for (uint8_t i = 0; i < 16; i++) {
+        if (entry->keymap[i])
+            config->keymap[i] = entry->keymap[i];
+    }
+    printf("Catalog settings for %.*s: %u ips, quirks 0x%X\n",
+           (int)strnlen(entry->path, sizeof entry->path), entry->path,
+           config->clk_speed, config->quirks);
+}
+
+// Records one span; a single branch when tracing is off
+void trace(tracer_t *tracer, const span_t span, const uint64_t begin,
+           const uint64_t end) {
+    if (!tracer->spans)
+        return;
+
+    if (tracer->count == TRACE_MAX_SPANS) {
+        tracer->dropped++;
+        return;
+    }
+    tracer->spans[tracer->count++] =
+        (trace_span_t){.begin = begin, .end = end, .span = span};
+}
+
+// Starts pacing from now, e.g. after a pause, without catching up
+void init_pacer(pacer_t *pacer) {
+    *pacer = (pacer_t){.start = SDL_GetPerformanceCounter()};
+}
+
+// Sleeps until the next frame is due. Events are pumped every millisecond
+// meanwhile, so SDL stamps key presses with when they arrived rather than
+// with the time of the next poll.
+void wait_frame(pacer_t *pacer) {
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t now = SDL_GetPerformanceCounter();
+    const uint64_t due = pacer->start + ++pacer->frames * freq / 60;
+    if (now > due && now - due > freq / 10)
+        init_pacer(pacer); // Far behind, e.g. a debugger stop; start over
+    while (now < due && (due - now) * 1000 / freq > 0) {
+        SDL_Delay(1);
+        SDL_PumpEvents();
+        now = SDL_GetPerformanceCounter();
+    }
+}
+
+// Performance counter initializer
+void init_stats(stats_t *stats) {
+    *stats = (stats_t){
+        .freq = SDL_GetPerformanceFrequency(),
+        .window_start = SDL_GetPerformanceCounter(),
+        .cpu_start = clock(),
+    };
+}
+
+// Counts a finished frame; once a second turns the sums into the averages
+// shown by the HUD and writes them to the stats file if one is set
+void update_stats(stats_t *stats, const config_t *config,
+                  const uint32_t instructions) {
+    stats->frames++;
+    stats->instructions += instructions;
+
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const double seconds = (double)(now - stats->window_start) / stats->freq;
+    if (seconds < 1.0)
+        return;
+
+    const double ms_per_frame = 1000.0 / stats->freq / stats->frames;
+    const double expected = seconds * 60;
+    const clock_t cpu_now = clock();
+
+    stats->ips = stats->instructions / seconds;
+    stats->emu_ms = stats->emu_ticks * ms_per_frame;
+    stats->render_ms = stats->render_ticks * ms_per_frame;
+    stats->present_ms = stats->present_ticks * ms_per_frame;
+    stats->sleep_ms = stats->sleep_ticks * ms_per_frame;
+    stats->dropped = expected > stats->frames ? expected - stats->frames : 0;
+    stats->cpu_percent = 100.0 * (cpu_now - stats->cpu_start) /
+                         CLOCKS_PER_SEC / seconds;
+
+    if (config->stats_file) {
+        fprintf(config->stats_file,
+                "ips %.0f/%u emu %.3fms render %.3fms present %.3fms "
+                "sleep %.3fms dropped %u cpu %.1f%%\n",
+                stats->ips, config->clk_speed, stats->emu_ms,
+                stats->render_ms, stats->present_ms, stats->sleep_ms,
+                stats->dropped, stats->cpu_percent);
+        fflush(config->stats_file);
+    }
+
+    // Start the next window
+    stats->window_start = now;
+    stats->cpu_start = cpu_now;
+    stats->frames = 0;
+    stats->instructions = 0;
+    stats->emu_ticks = stats->render_ticks = 0;
+    stats->present_ticks = stats->sleep_ticks = 0;
+}
+
 // Clears screen to background colour set in config
 void clear_screen(const sdl_t *sdl, const config_t *config) {
     const uint8_t r = (config->bg_colour >> 24) & 0xFF;
@@ -991,6 +2649,444 @@ void clear_screen(const sdl_t *sdl, const config_t *config) {
     SDL_RenderClear(sdl->rend);
 }
 
+// Unmaps and removes the shared memory segment
+void cleanup_shm(shm_t *shm, const config_t *config) {
+    if (!shm->frame)
+        return;
+
+    munmap(shm->frame, sizeof *shm->frame);
+    shm_unlink(config->shm_name);
+    shm->frame = NULL;
+}
+
+// Stops the recorder once the worker has written every queued frame
+void cleanup_recorder(recorder_t *rec) {
+    if (!rec->file)
+        return;
+
+    atomic_store_explicit(&rec->running, false, memory_order_release);
+    pthread_join(rec->worker, NULL);
+    fclose(rec->file);
+    rec->file = NULL;
+    printf("Recorded %llu frames\n", (unsigned long long)rec->frames);
+}
+
+// Converts a --record file to a stream of binary PBM images, one per frame.
+// The result can be fed to other tools, e.g.
+//   ffmpeg -f image2pipe -c:v pbm -framerate 60 -i out.pbm out.gif
+bool convert_recording(const config_t *config) {
+    FILE *in = fopen(config->convert_in, "rb");
+    if (!in) {
+        SDL_Log("Could not open recording %s\n", config->convert_in);
+        return false;
+    }
+
+    char magic[sizeof RECORD_MAGIC - 1];
+    uint8_t dims[4];
+    if (fread(magic, sizeof magic, 1, in) != 1 ||
+        memcmp(magic, RECORD_MAGIC, sizeof magic) != 0 ||
+        fread(dims, sizeof dims, 1, in) != 1) {
+        SDL_Log("%s is not a recording\n", config->convert_in);
+        fclose(in);
+        return false;
+    }
+    const uint32_t width = dims[0] | dims[1] << 8;
+    const uint32_t height = dims[2] | dims[3] << 8;
+
+    FILE *out = fopen(config->convert_out, "wb");
+    if (!out) {
+        SDL_Log("Could not open output %s\n", config->convert_out);
+        fclose(in);
+        return false;
+    }
+
+    uint8_t frame[64 * 32 / 8] = {0};
+    const uint32_t frame_size = width * height / 8;
+    if (frame_size != sizeof frame) {
+        SDL_Log("Unsupported recording size %ux%u\n", width, height);
+        fclose(in);
+        fclose(out);
+        return false;
+    }
+
+    uint64_t frames = 0;
+    int dropped;
+    bool ok = true;
+    while (ok && (dropped = fgetc(in)) != EOF) {
+        // Repeat the last frame for dropped frames to keep the timing
+        for (int i = 0; i < dropped; i++) {
+            fprintf(out, "P4\n%u %u\n", width, height);
+            fwrite(frame, 1, frame_size, out);
+            frames++;
+        }
+
+        // Apply this frame's runs on top of the previous frame
+        for (uint32_t pos = 0; ok && pos < frame_size;) {
+            const int skip = fgetc(in);
+            const int lit = fgetc(in);
+            if (skip == EOF || lit == EOF || pos + skip + lit > frame_size) {
+                ok = false;
+                break;
+            }
+            pos += skip;
+            for (int j = 0; j < lit; j++) {
+                const int byte = fgetc(in);
+                if (byte == EOF) {
+                    ok = false;
+                    break;
+                }
+                frame[pos++] ^= byte;
+            }
+        }
+        if (!ok)
+            break;
+
+        fprintf(out, "P4\n%u %u\n", width, height);
+        fwrite(frame, 1, frame_size, out);
+        frames++;
+    }
+
+    if (!ok)
+        SDL_Log("Recording %s is truncated\n", config->convert_in);
+    printf("Converted %llu frames\n", (unsigned long long)frames);
+    fclose(in);
+    fclose(out);
+    return ok;
+}
+
+// Reads the optional settings file <rom>.cfg next to a ROM, lines of
+//   clk_speed=<instructions per second>
+//   quirks=<profile or number, see --quirks>
+//   keymap=<16 host keys for CHIP8 keys 0-F, e.g. x123qweasdzc4rfv>
+bool read_rom_settings(catalog_entry_t *entry, const char *rom_path) {
+    char path[PATH_MAX + 8];
+    snprintf(path, sizeof path, "%s.cfg", rom_path);
+    FILE *cfg = fopen(path, "r");
+    if (!cfg)
+        return true; // No settings, defaults are used
+
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof line, cfg)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *value = strchr(line, '=');
+        if (line[0] == '#' || !value)
+            continue;
+        *value++ = '\0';
+
+        if (strcmp(line, "clk_speed") == 0) {
+            entry->clk_speed = strtoul(value, NULL, 10);
+        } else if (strcmp(line, "quirks") == 0) {
+            ok = parse_quirks(value, &entry->quirks);
+        } else if (strcmp(line, "keymap") == 0) {
+            ok = strlen(value) == 16;
+            for (uint8_t i = 0; ok && i < 16; i++)
+                entry->keymap[i] = tolower((unsigned char)value[i]);
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok)
+        SDL_Log("Bad setting \"%s\" in %s\n", line, path);
+    fclose(cfg);
+    return ok;
+}
+
+// Adds every ROM below dir to a growing list of catalog entries. Symlinks
+// are skipped, so a link back up the tree cannot recurse forever.
+bool scan_roms(const char *dir, catalog_entry_t **entries, uint32_t *n,
+               uint32_t *cap) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        SDL_Log("Could not open ROM directory %s\n", dir);
+        return false;
+    }
+
+    bool ok = true;
+    const struct dirent *ent;
+    while (ok && (ent = readdir(d))) {
+        char path[PATH_MAX];
+        struct stat st;
+        const char *ext = strrchr(ent->d_name, '.');
+        if (ent->d_name[0] == '.' || (ext && strcmp(ext, ".cfg") == 0) ||
+            snprintf(path, sizeof path, "%s/%s", dir, ent->d_name) >=
+                (int)sizeof path ||
+            lstat(path, &st) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            ok = scan_roms(path, entries, n, cap);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || !st.st_size ||
+            st.st_size > CATALOG_MAX_ROM)
+            continue; // Not something that fits in ram
+
+        FILE *rom = fopen(path, "rb");
+        uint8_t data[CATALOG_MAX_ROM];
+        const size_t size = rom ? fread(data, 1, sizeof data, rom) : 0;
+        if (rom)
+            fclose(rom);
+        if (!size)
+            continue;
+
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            catalog_entry_t *grown = realloc(*entries, *cap * sizeof **entries);
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            *entries = grown;
+        }
+
+        catalog_entry_t *entry = &(*entries)[(*n)++];
+        *entry = (catalog_entry_t){.hash = hash_bytes(data, size)};
+        memcpy(entry->path, path, strnlen(path, sizeof entry->path - 1));
+        ok = read_rom_settings(entry, path);
+    }
+    closedir(d);
+    return ok;
+}
+
+// Builds the ROM catalog from the directories given on the command line,
+// replacing any previous one
+bool build_catalog(const config_t *config) {
+    catalog_entry_t *found = NULL;
+    uint32_t n = 0, cap = 0;
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < config->n_roms; i++)
+        ok = scan_roms(config->rom_names[i], &found, &n, &cap);
+
+    // At most half full keeps probe sequences short
+    uint32_t n_slots = 16;
+    while (n_slots < n * 2)
+        n_slots *= 2;
+    catalog_header_t *catalog =
+        ok ? calloc(1, sizeof *catalog + n_slots * sizeof found[0]) : NULL;
+    if (!catalog) {
+        free(found);
+        return false;
+    }
+    memcpy(catalog->magic, CATALOG_MAGIC, sizeof catalog->magic);
+    catalog->n_slots = n_slots;
+
+    // The same ROM found twice keeps the first path and settings
+    for (uint32_t i = 0; i < n; i++) {
+        const uint32_t mask = n_slots - 1;
+        uint32_t slot = found[i].hash & mask;
+        while (catalog->entries[slot].hash &&
+               catalog->entries[slot].hash != found[i].hash)
+            slot = (slot + 1) & mask;
+        if (catalog->entries[slot].hash)
+            continue;
+        catalog->entries[slot] = found[i];
+        catalog->n_roms++;
+    }
+
+    FILE *out = fopen(config->catalog_name, "wb");
+    ok = out && fwrite(catalog, sizeof *catalog + n_slots * sizeof found[0],
+                       1, out) == 1;
+    if (out && fclose(out) != 0)
+        ok = false;
+    if (ok)
+        printf("Catalogued %u ROMs in %s\n", catalog->n_roms,
+               config->catalog_name);
+    else
+        SDL_Log("Could not write catalog %s\n", config->catalog_name);
+
+    free(catalog);
+    free(found);
+    return ok;
+}
+
+#ifdef COVERAGE
+// Writes <prefix>.txt, a summary of executed/read/written ram with the opcode
+// patterns seen, and <prefix>.ppm, a 64x64 map of ram scaled up 8x with one
+// square per address: green = code, red = data read, blue = data written,
+// grey = loaded but untouched
+bool write_coverage(const chip8_t *chip8, const config_t *config) {
+    const uint32_t entry_point = 0x200;
+    char path[512];
+#define COVERED(map, addr) ((chip8->map[(addr) / 8] >> ((addr) % 8)) & 1)
+
+    snprintf(path, sizeof path, "%s.txt", config->coverage_name);
+    FILE *txt = fopen(path, "w");
+    if (!txt) {
+        SDL_Log("Could not write coverage report %s\n", path);
+        return false;
+    }
+
+    fprintf(txt, "ROM: %s (%u bytes)\n", chip8->rom_name, chip8->rom_size);
+
+    // Opcodes executed, grouped by pattern; fetches only mark the first byte
+    const char *seen[64];
+    uint32_t counts[64] = {0}, n_seen = 0, n_exec = 0, n_read = 0, n_write = 0;
+    for (uint32_t addr = 0; addr < RAM_SIZE; addr++) {
+        n_read += COVERED(cov_read, addr);
+        n_write += COVERED(cov_write, addr);
+        if (!COVERED(cov_exec, addr))
+            continue;
+
+        n_exec++;
+        const uint16_t opcode =
+            RAM(chip8, addr) << 8 | RAM(chip8, addr + 1);
+        const char *pattern = opcode_pattern(opcode);
+        uint32_t i = 0;
+        while (i < n_seen && seen[i] != pattern)
+            i++;
+        if (i == n_seen)
+            seen[n_seen++] = pattern;
+        counts[i]++;
+    }
+
+    fprintf(txt, "Executed: %u instructions\n", n_exec);
+    fprintf(txt, "Read as data: %u bytes\n", n_read);
+    fprintf(txt, "Written: %u bytes\n", n_write);
+
+    // Per address flags; the second byte of an executed opcode is code too
+    enum { CODE = 1, READ = 2, WRITE = 4 };
+    uint8_t kind[RAM_SIZE];
+    for (uint32_t addr = 0; addr < RAM_SIZE; addr++) {
+        kind[addr] = (COVERED(cov_exec, addr) ||
+                      (addr > 0 && COVERED(cov_exec, addr - 1))) * CODE |
+                     COVERED(cov_read, addr) * READ |
+                     COVERED(cov_write, addr) * WRITE;
+    }
+
+    // Address ranges per kind
+    const struct {
+        const char *name;
+        uint8_t flag;
+    } kinds[] = {{"Code", CODE}, {"Data read", READ}, {"Data written", WRITE}};
+    for (uint32_t k = 0; k < sizeof kinds / sizeof kinds[0]; k++) {
+        fprintf(txt, "%s:", kinds[k].name);
+        for (uint32_t addr = 0; addr < RAM_SIZE; addr++) {
+            if (!(kind[addr] & kinds[k].flag))
+                continue;
+            uint32_t end = addr;
+            while (end + 1 < RAM_SIZE &&
+                   (kind[end + 1] & kinds[k].flag))
+                end++;
+            fprintf(txt, " 0x%03X-0x%03X", addr, end);
+            addr = end;
+        }
+        fputc('\n', txt);
+    }
+
+    fprintf(txt, "Opcodes:\n");
+    for (uint32_t i = 0; i < n_seen; i++)
+        fprintf(txt, "  %s %u\n", seen[i], counts[i]);
+    fclose(txt);
+
+    // Memory map overlay
+    const uint32_t scale = 8, side = 64;
+    snprintf(path, sizeof path, "%s.ppm", config->coverage_name);
+    FILE *ppm = fopen(path, "wb");
+    if (!ppm) {
+        SDL_Log("Could not write coverage map %s\n", path);
+        return false;
+    }
+
+    fprintf(ppm, "P6\n%u %u\n255\n", side * scale, side * scale);
+    for (uint32_t y = 0; y < side * scale; y++) {
+        for (uint32_t x = 0; x < side * scale; x++) {
+            const uint32_t addr = (y / scale) * side + x / scale;
+            const bool loaded =
+                addr < 80 || // Font
+                (addr >= entry_point && addr < entry_point + chip8->rom_size);
+            uint8_t rgb[3] = {0x20, 0x20, 0x20}; // Unused
+            if (loaded)
+                memcpy(rgb, (uint8_t[]){0x60, 0x60, 0x60}, sizeof rgb);
+            if (kind[addr] & CODE)
+                memcpy(rgb, (uint8_t[]){0x00, 0xD0, 0x40}, sizeof rgb);
+            if (kind[addr] & READ)
+                rgb[0] = 0xE0; // Red, or yellow when also code
+            if (kind[addr] & WRITE)
+                rgb[2] = 0xF0; // Blue, or mixed with the above
+            fwrite(rgb, 1, sizeof rgb, ppm);
+        }
+    }
+    fclose(ppm);
+#undef COVERED
+
+    printf("Coverage written to %s.txt and %s.ppm\n", config->coverage_name,
+           config->coverage_name);
+    return true;
+}
+#endif
+
+// Writes recorded spans as Chrome trace event JSON, for chrome://tracing or
+// ui.perfetto.dev, and frees the buffer
+bool write_trace(tracer_t *tracer, const config_t *config) {
+    if (!tracer->spans)
+        return true;
+
+    static const char *const names[] = {
+        [SPAN_FRAME] = "frame",
+        [SPAN_INPUT] = "handle_input",
+        [SPAN_EMULATE] = "emulate_instruct batch",
+        [SPAN_DELAY] = "SDL_Delay",
+        [SPAN_RUN_AHEAD] = "run ahead",
+        [SPAN_SCREEN] = "update_screen",
+        [SPAN_PRESENT] = "SDL_RenderPresent",
+        [SPAN_TIMERS] = "update_timers",
+    };
+
+    FILE *out = fopen(config->trace_name, "w");
+    if (!out) {
+        SDL_Log("Could not write trace %s\n", config->trace_name);
+        free(tracer->spans);
+        tracer->spans = NULL;
+        return false;
+    }
+
+    // Frames on one track, the work inside them on another
+    const double us_per_tick = 1e6 / SDL_GetPerformanceFrequency();
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":1,\"args\":{\"name\":\"frames\"}},\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"tid\":2,\"args\":{\"name\":\"main loop\"}}");
+    for (uint32_t i = 0; i < tracer->count; i++) {
+        const trace_span_t *span = &tracer->spans[i];
+        fprintf(out,
+                ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f}",
+                names[span->span], span->span == SPAN_FRAME ? 1 : 2,
+                (span->begin - tracer->start) * us_per_tick,
+                (span->end - span->begin) * us_per_tick);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    printf("Trace of %u spans written to %s", tracer->count,
+           config->trace_name);
+    if (tracer->dropped)
+        printf(" (%u dropped, buffer full)", tracer->dropped);
+    putchar('\n');
+
+    free(tracer->spans);
+    tracer->spans = NULL;
+    return true;
+}
+
+// Stops watching the ROM file
+void cleanup_rom_watch(rom_watch_t *watch) {
+    if (watch->fd >= 0)
+        close(watch->fd);
+    free(watch->dir);
+    free(watch->file);
+    *watch = (rom_watch_t){.fd = -1};
+}
+
+// Unmaps the ROM catalog
+void cleanup_catalog(catalog_t *catalog) {
+    if (catalog->map)
+        munmap(catalog->map, catalog->size);
+    *catalog = (catalog_t){0};
+}
+
 // Cleanup Function
 void final_cleanup(sdl_t *sdl) {
     SDL_DestroyRenderer(sdl->rend);
@@ -998,62 +3094,871 @@ void final_cleanup(sdl_t *sdl) {
     SDL_Quit();
 }
 
+// Multi-session mode: runs config->sessions machines and composites all
+// displays into one texture, uploaded and presented once per frame. Returns
+// false if the sessions could not be set up.
+bool run_sessions(const sdl_t *sdl, const config_t *config) {
+    const uint32_t n = config->sessions;
+    const uint32_t tile_w = config->window_width;
+    const uint32_t tile_h = config->window_height;
+    const uint32_t atlas_w = tile_w * config->tile_cols;
+    const uint32_t atlas_h = tile_h * config->tile_rows;
+
+    chip8_t *chip8 = calloc(n, sizeof *chip8);
+    uint32_t *pixels = calloc(atlas_w * atlas_h, sizeof *pixels);
+    SDL_Texture *atlas =
+        SDL_CreateTexture(sdl->rend, SDL_PIXELFORMAT_ARGB8888,
+                          SDL_TEXTUREACCESS_STREAMING, atlas_w, atlas_h);
+    bool ok = chip8 && pixels && atlas;
+    if (!ok)
+        SDL_Log("Could not set up %u sessions %s\n", n, SDL_GetError());
+
+    // ROMs are handed out round robin
+    for (uint32_t i = 0; ok && i < n; i++) {
+        ok = init_chip8(&chip8[i], config->rom_names[i % config->n_roms]);
+        chip8[i].rng = ((uint32_t)time(NULL) + i * 0x9E3779B9u) | 1;
+        chip8[i].quirks = config->quirks;
+        chip8[i].vip_timing = config->vip_timing;
+    }
+
+    // Config colours are RRGGBBAA, the texture wants AARRGGBB
+    const uint32_t fg = config->fg_colour >> 8 | config->fg_colour << 24;
+    const uint32_t bg = config->bg_colour >> 8 | config->bg_colour << 24;
+    pacer_t pacer;
+    init_pacer(&pacer);
+    host_t host = {0};
+    uint32_t focus = host.focus;
+
+    for (uint64_t frame = 0; ok && chip8[focus].state != QUIT; frame++) {
+        handle_input(&chip8[focus], config, &host, NULL);
+
+        if (host.focus != focus) {
+            // Release keys held on the session losing focus
+            memset(chip8[focus].keypad, false, sizeof chip8[focus].keypad);
+            if (chip8[focus].state == QUIT)
+                break;
+            focus = host.focus;
+        }
+
+        // Sleep while every session is paused
+        uint32_t running = 0;
+        for (uint32_t i = 0; i < n; i++)
+            running += chip8[i].state == RUNNING;
+        if (!running) {
+            wait_input(config);
+            init_pacer(&pacer);
+            continue;
+        }
+
+        const bool render = should_render(&host, frame);
+        for (uint32_t i = 0; i < n; i++) {
+            if (chip8[i].state != RUNNING)
+                continue;
+            emulate_frame(&chip8[i], config, NULL);
+            update_timers(&chip8[i]);
+            if (!render)
+                continue;
+
+            // Blit into this session's tile of the atlas
+            uint32_t *tile = pixels +
+                             (i / config->tile_cols) * tile_h * atlas_w +
+                             (i % config->tile_cols) * tile_w;
+            for (uint32_t y = 0; y < tile_h; y++)
+                for (uint32_t x = 0; x < tile_w; x++)
+                    tile[y * atlas_w + x] =
+                        chip8[i].display[y * tile_w + x] ? fg : bg;
+        }
+
+        if (render) {
+            SDL_UpdateTexture(atlas, NULL, pixels, atlas_w * sizeof *pixels);
+            SDL_RenderCopy(sdl->rend, atlas, NULL, NULL);
+
+            // Outline the focused session
+            const SDL_Rect outline = {
+                (focus % config->tile_cols) * tile_w * config->scaler,
+                (focus / config->tile_cols) * tile_h * config->scaler,
+                tile_w * config->scaler, tile_h * config->scaler};
+            SDL_SetRenderDrawColor(sdl->rend, 0xFF, 0xFF, 0x00, 0xFF);
+            SDL_RenderDrawRect(sdl->rend, &outline);
+            SDL_RenderPresent(sdl->rend);
+        }
+
+        // Sleep until the next 60Hz frame is due
+        wait_frame(&pacer);
+    }
+
+    if (atlas)
+        SDL_DestroyTexture(atlas);
+    free(pixels);
+    for (uint32_t i = 0; chip8 && i < n; i++)
+        cleanup_chip8(&chip8[i]);
+    free(chip8);
+    return ok;
+}
+
+// Runs one job line on a worker's machine and formats the reply. A job is
+// space separated key=value fields:
+//   id=<text>              echoed in the reply
+//   rom=<path> | hex=<ROM> ROM file, or the ROM itself in hex
+//   frames=<n>             60Hz frames to run, default 60
+//   keys=<f>:<mask>,...    keypad bitmask (hex) held from frame f onwards,
+//                          frames in increasing order
+//   quirks=<profile>       as --quirks
+//   vip=1                  COSMAC VIP timing
+// and the reply one line, either
+//   id=<id> ok hash=<FNV-1a of the display> instructions=<n> faults=<FAULT_*>
+//          pc=<PC> us=<run time>
+//   id=<id> error <reason>
+void run_job(chip8_t *chip8, const config_t *config, char *line,
+             char reply[], const size_t size) {
+    const char *id = "-";
+    const char *error = NULL;
+    char *rom = NULL, *hex = NULL, *keys = NULL, *save;
+    uint32_t frames = 60;
+    uint8_t quirks = config->quirks;
+    bool vip_timing = config->vip_timing;
+
+    for (char *field = strtok_r(line, " \t", &save); field && !error;
+         field = strtok_r(NULL, " \t", &save)) {
+        char *value = strchr(field, '=');
+        if (!value) {
+            error = "field without a value";
+            break;
+        }
+        *value++ = '\0';
+
+        if (strcmp(field, "id") == 0) {
+            id = value;
+        } else if (strcmp(field, "rom") == 0) {
+            rom = value;
+        } else if (strcmp(field, "hex") == 0) {
+            hex = value;
+        } else if (strcmp(field, "frames") == 0) {
+            char *end;
+            frames = strtoul(value, &end, 10);
+            if (!isdigit((unsigned char)value[0]) || *end)
+                error = "bad frame count";
+            else if (frames > SERVER_MAX_FRAMES)
+                error = "too many frames";
+        } else if (strcmp(field, "keys") == 0) {
+            keys = value;
+        } else if (strcmp(field, "quirks") == 0) {
+            if (!parse_quirks(value, &quirks))
+                error = "unknown quirk profile";
+        } else if (strcmp(field, "vip") == 0) {
+            vip_timing = strcmp(value, "0") != 0;
+        } else {
+            error = "unknown field";
+        }
+    }
+
+    // Input script, frame numbers strictly increasing
+    uint32_t key_frame[SERVER_MAX_KEYS];
+    uint16_t key_mask[SERVER_MAX_KEYS];
+    uint32_t n_keys = 0;
+    for (char *entry = keys && !error ? strtok_r(keys, ",", &save) : NULL;
+         entry && !error; entry = strtok_r(NULL, ",", &save)) {
+        char *end;
+        if (n_keys == SERVER_MAX_KEYS) {
+            error = "input script too long";
+            break;
+        }
+        key_frame[n_keys] = strtoul(entry, &end, 10);
+        if (!isdigit((unsigned char)entry[0]) || *end != ':' ||
+            !isxdigit((unsigned char)end[1]) ||
+            (n_keys && key_frame[n_keys] <= key_frame[n_keys - 1])) {
+            error = "bad input script";
+            break;
+        }
+        key_mask[n_keys] = strtoul(end + 1, &end, 16);
+        if (*end) {
+            error = "bad input script";
+            break;
+        }
+        n_keys++;
+    }
+
+    if (!error && hex) {
+        uint8_t data[RAM_SIZE];
+        const size_t len = strlen(hex);
+        if (len % 2 || len / 2 > sizeof data)
+            error = "bad hex ROM";
+        for (size_t i = 0; !error && i < len / 2; i++) {
+            if (!isxdigit((unsigned char)hex[2 * i]) ||
+                !isxdigit((unsigned char)hex[2 * i + 1])) {
+                error = "bad hex ROM";
+                break;
+            }
+            const char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+            data[i] = strtoul(byte, NULL, 16);
+        }
+        if (!error && !load_chip8(chip8, data, len / 2))
+            error = "ROM too big";
+    } else if (!error && rom) {
+        if (!init_chip8(chip8, rom))
+            error = "could not load ROM";
+    } else if (!error) {
+        error = "no ROM given";
+    }
+
+    if (error) {
+        snprintf(reply, size, "id=%.64s error %s\n", id, error);
+        return;
+    }
+
+    // Fixed seed so the same job always gives the same result
+    chip8->rng = 1;
+    chip8->quirks = quirks;
+    chip8->vip_timing = vip_timing;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t instructions = 0;
+    for (uint32_t f = 0, k = 0; f < frames; f++) {
+        for (; k < n_keys && key_frame[k] <= f; k++) {
+            for (uint8_t i = 0; i < sizeof chip8->keypad; i++)
+                chip8->keypad[i] = key_mask[k] >> i & 1;
+        }
+        instructions += emulate_frame(chip8, config, NULL);
+        update_timers(chip8);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint8_t packed[sizeof chip8->display / 8];
+    pack_display(chip8, packed);
+    snprintf(reply, size,
+             "id=%.64s ok hash=%016llx instructions=%llu faults=0x%02X "
+             "pc=0x%03X us=%llu\n",
+             id, (unsigned long long)hash_bytes(packed, sizeof packed),
+             (unsigned long long)instructions, chip8->faults, chip8->PC,
+             (unsigned long long)((end.tv_sec - start.tv_sec) * 1000000 +
+                                  (end.tv_nsec - start.tv_nsec) / 1000));
+}
+
+// Job server worker thread: runs queued jobs on one machine, reloaded for
+// each job, until the server closes
+void *job_worker(void *arg) {
+    job_server_t *server = arg;
+    chip8_t chip8 = {0};
+    char reply[256];
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->count && !server->closing)
+            pthread_cond_wait(&server->not_empty, &server->lock);
+        if (!server->count) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        char *line = server->jobs[server->head];
+        server->head = (server->head + 1) % SERVER_QUEUE;
+        server->count--;
+        server->busy++;
+        pthread_cond_signal(&server->not_full);
+        pthread_mutex_unlock(&server->lock);
+
+        run_job(&chip8, server->config, line, reply, sizeof reply);
+        free(line);
+
+        // Whole lines only; a client that went away just loses its replies
+        pthread_mutex_lock(&server->out_lock);
+        for (size_t done = 0, len = strlen(reply); done < len;) {
+            const ssize_t n = write(server->out_fd, reply + done, len - done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        pthread_mutex_unlock(&server->out_lock);
+
+        pthread_mutex_lock(&server->lock);
+        if (--server->busy == 0 && !server->count)
+            pthread_cond_broadcast(&server->idle);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    cleanup_chip8(&chip8);
+    return NULL;
+}
+
+// Queues every job line a client sends, then waits until all are answered.
+// Returns false if the client sent "quit" to stop the server.
+bool serve_client(job_server_t *server, FILE *in, const int out_fd) {
+    pthread_mutex_lock(&server->lock);
+    server->out_fd = out_fd;
+    pthread_mutex_unlock(&server->lock);
+
+    char *line = NULL;
+    size_t cap = 0;
+    bool quit = false;
+    while (!quit && getline(&line, &cap, in) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0] || line[0] == '#')
+            continue;
+        if (strcmp(line, "quit") == 0) {
+            quit = true;
+            break;
+        }
+
+        char *job = strdup(line);
+        if (!job)
+            break;
+        pthread_mutex_lock(&server->lock);
+        while (server->count == SERVER_QUEUE)
+            pthread_cond_wait(&server->not_full, &server->lock);
+        server->jobs[(server->head + server->count) % SERVER_QUEUE] = job;
+        server->count++;
+        pthread_cond_signal(&server->not_empty);
+        pthread_mutex_unlock(&server->lock);
+    }
+    free(line);
+
+    pthread_mutex_lock(&server->lock);
+    while (server->count || server->busy)
+        pthread_cond_wait(&server->idle, &server->lock);
+    pthread_mutex_unlock(&server->lock);
+    return !quit;
+}
+
+// Runs one --detect-quirks trial. Per frame it looks for the PC outside the
+// loaded ROM, instructions run from addresses the ROM used as sprite data or
+// wrote to, and changes to the display. Faults count heavily against it.
+void *run_quirk_trial(void *arg) {
+    quirk_trial_t *trial = arg;
+    chip8_t *chip8 = &trial->chip8;
+    const uint32_t rom_end = 0x200 + chip8->rom_size;
+    uint8_t data[RAM_SIZE / 8] = {0}; // Addresses used as data
+    bool shown[sizeof chip8->display];
+    memcpy(shown, chip8->display, sizeof shown);
+
+    int32_t active = 0, stray = 0, into_data = 0;
+    for (uint32_t f = 0; f < DETECT_FRAMES; f++) {
+        bool strayed = false, ran_data = false;
+        for (uint32_t i = 0; i < trial->config->clk_speed / 60; i++) {
+            const uint16_t pc = chip8->PC & 0xFFF;
+            strayed |= pc < 0x200 || pc >= rom_end;
+            ran_data |= data[pc / 8] >> (pc % 8) & 1;
+
+            // Note the addresses this instruction reads sprites from or
+            // stores to
+            const uint16_t opcode = RAM(chip8, pc) << 8 | RAM(chip8, pc + 1);
+            uint16_t n = 0;
+            if (opcode >> 12 == 0xD)
+                n = opcode & 0xF;
+            else if ((opcode & 0xF0FF) == 0xF033)
+                n = 3;
+            else if ((opcode & 0xF0FF) == 0xF055)
+                n = (opcode >> 8 & 0xF) + 1;
+            for (uint16_t j = 0; j < n; j++) {
+                const uint16_t addr = (chip8->I + j) & 0xFFF;
+                data[addr / 8] |= 1 << (addr % 8);
+            }
+
+            emulate_instruct(chip8, trial->config);
+        }
+        update_timers(chip8);
+
+        if (memcmp(shown, chip8->display, sizeof shown)) {
+            memcpy(shown, chip8->display, sizeof shown);
+            active++;
+        }
+        stray += strayed;
+        into_data += ran_data;
+    }
+
+    trial->score = active - 4 * stray - 4 * into_data;
+    if (chip8->faults)
+        trial->score -= 1000;
+    return NULL;
+}
+
+// Runs the loaded ROM under every combination of quirks, each in its own
+// thread on a clone of the machine, and returns the best scoring one. Ties
+// go to the fewest quirks, so ROMs that behave the same either way keep the
+// default behaviour.
+uint8_t detect_quirks(const config_t *config, const chip8_t *chip8) {
+    const uint32_t n = QUIRK_ALL + 1;
+    quirk_trial_t *trials = calloc(n, sizeof *trials);
+    pthread_t *threads = calloc(n, sizeof *threads);
+    bool *started = calloc(n, sizeof *started);
+    if (!trials || !threads || !started) {
+        SDL_Log("Could not detect quirks, out of memory\n");
+        free(trials);
+        free(threads);
+        free(started);
+        return config->quirks;
+    }
+
+    for (uint32_t q = 0; q < n; q++) {
+        clone_chip8(&trials[q].chip8, chip8);
+        trials[q].chip8.rng = 1; // Same random numbers in every trial
+        trials[q].chip8.quirks = q;
+        trials[q].chip8.vip_timing = false;
+        trials[q].config = config;
+        started[q] = pthread_create(&threads[q], NULL, run_quirk_trial,
+                                    &trials[q]) == 0;
+        if (!started[q])
+            run_quirk_trial(&trials[q]); // Run it here instead
+    }
+
+    uint8_t best = 0;
+    for (uint32_t q = 0; q < n; q++) {
+        if (started[q])
+            pthread_join(threads[q], NULL);
+    }
+    for (uint32_t q = 1; q < n; q++) {
+        uint32_t bits = 0, best_bits = 0;
+        for (uint8_t b = 0; b < 4; b++) {
+            bits += q >> b & 1;
+            best_bits += best >> b & 1;
+        }
+        if (trials[q].score > trials[best].score ||
+            (trials[q].score == trials[best].score && bits < best_bits))
+            best = q;
+    }
+    printf("Detected quirks 0x%X (score %d, default scored %d)\n", best,
+           trials[best].score, trials[0].score);
+
+    for (uint32_t q = 0; q < n; q++)
+        cleanup_chip8(&trials[q].chip8);
+    free(trials);
+    free(threads);
+    free(started);
+    return best;
+}
+
+// Headless job server: starts one worker per CPU, then takes jobs from stdin
+// (replying on stdout) or from clients of a Unix domain socket, one client
+// at a time, until a client sends "quit" or stdin ends
+bool run_server(const config_t *config) {
+    job_server_t server = {.config = config, .out_fd = STDOUT_FILENO};
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_mutex_init(&server.out_lock, NULL);
+    pthread_cond_init(&server.not_empty, NULL);
+    pthread_cond_init(&server.not_full, NULL);
+    pthread_cond_init(&server.idle, NULL);
+
+    pthread_t workers[64];
+    long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers < 1)
+        n_workers = 1;
+    if (n_workers > (long)(sizeof workers / sizeof workers[0]))
+        n_workers = sizeof workers / sizeof workers[0];
+    for (long i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i], NULL, job_worker, &server) != 0) {
+            SDL_Log("Could not start job worker\n");
+            n_workers = i;
+            break;
+        }
+    }
+
+    // A client hanging up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    bool ok = n_workers > 0;
+    if (ok && strcmp(config->server_name, "-") == 0) {
+        serve_client(&server, stdin, STDOUT_FILENO);
+    } else if (ok) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ok = fd >= 0 && strlen(config->server_name) < sizeof addr.sun_path;
+        // Only replace a socket left over from a previous run, never a file
+        struct stat st;
+        if (ok && lstat(config->server_name, &st) == 0) {
+            ok = S_ISSOCK(st.st_mode) && unlink(config->server_name) == 0;
+            if (!ok)
+                SDL_Log("%s exists and is not a socket\n",
+                        config->server_name);
+        }
+        if (ok) {
+            strcpy(addr.sun_path, config->server_name);
+            ok = bind(fd, (struct sockaddr *)&addr, sizeof addr) == 0 &&
+                 listen(fd, 16) == 0;
+        }
+        if (!ok)
+            SDL_Log("Could not listen on %s\n", config->server_name);
+        else
+            printf("Serving jobs on %s with %ld workers\n",
+                   config->server_name, n_workers);
+        fflush(stdout);
+
+        for (bool more = ok; more;) {
+            const int client = accept(fd, NULL, NULL);
+            if (client < 0) {
+                more = ok = errno == EINTR;
+                continue;
+            }
+            FILE *in = fdopen(client, "r");
+            if (!in) {
+                close(client);
+                continue;
+            }
+            more = serve_client(&server, in, client);
+            fclose(in);
+        }
+        if (fd >= 0)
+            close(fd);
+        if (ok)
+            unlink(config->server_name);
+    }
+
+    pthread_mutex_lock(&server.lock);
+    server.closing = true;
+    pthread_cond_broadcast(&server.not_empty);
+    pthread_mutex_unlock(&server.lock);
+    for (long i = 0; i < n_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    pthread_cond_destroy(&server.idle);
+    pthread_cond_destroy(&server.not_full);
+    pthread_cond_destroy(&server.not_empty);
+    pthread_mutex_destroy(&server.out_lock);
+    pthread_mutex_destroy(&server.lock);
+    return ok;
+}
+
+#ifdef FUZZ
+//====================== FUZZING ======================//
+
+// True if two machines hold the same ram contents
+bool same_ram(const chip8_t *a, const chip8_t *b) {
+    for (uint32_t i = 0; i < RAM_PAGES; i++) {
+        if (a->ram[i] != b->ram[i] &&
+            memcmp(a->ram[i]->data, b->ram[i]->data, RAM_PAGE_SIZE))
+            return false;
+    }
+    return true;
+}
+
+// True if two machines are in the same emulated state
+bool same_chip8(const chip8_t *a, const chip8_t *b) {
+    return a->state == b->state && a->PC == b->PC && a->I == b->I &&
+           a->delay_timer == b->delay_timer &&
+           a->sound_timer == b->sound_timer && a->rng == b->rng &&
+           a->any_key_pressed == b->any_key_pressed && a->key == b->key &&
+           a->cycle_budget == b->cycle_budget && a->faults == b->faults &&
+           a->inst.opcode == b->inst.opcode &&
+           a->stack_ptr - a->stack == b->stack_ptr - b->stack &&
+           same_ram(a, b) &&
+           !memcmp(a->display, b->display, sizeof a->display) &&
+           !memcmp(a->V, b->V, sizeof a->V) &&
+           !memcmp(a->stack, b->stack, sizeof a->stack) &&
+           !memcmp(a->keypad, b->keypad, sizeof a->keypad);
+}
+
+// libFuzzer entry point (make fuzz / make fuzz-diff). Input layout:
+//   byte 0:        bit 0 set = COSMAC VIP timing, bits 1-4 = QUIRK_* bits
+//   byte 1:        F, frames of keypad input that follow (at least 1 frame
+//                  is run)
+//   F x 2 bytes:   keypad bitmask held during each frame, little endian;
+//                  without FUZZ_DIFF changes go through the input queue
+//   rest:          ROM image
+// With FUZZ_DIFF a second machine steps every instruction through a fresh
+// clone_chip8() copy, the path run ahead relies on, and must stay identical
+// to the first after each instruction. A clone taken at load must still hold
+// the loaded ram at the end, i.e. no write reached a shared page.
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static config_t config;
+    static bool ready = false;
+    if (!ready) {
+        char *argv[] = {"chip8", "fuzz.ch8", NULL};
+        ready = init_config(&config, 2, argv);
+    }
+
+    if (size < 2)
+        return 0;
+
+    const uint32_t frames = data[1];
+    if (size < 2 + 2 * frames)
+        return 0;
+    const uint8_t *keys = data + 2;
+    const uint8_t *rom = keys + 2 * frames;
+    const size_t rom_size = size - 2 - 2 * frames;
+    if (rom_size > RAM_SIZE - 0x200)
+        return 0; // load_chip8() would only log that it is too big
+
+    static chip8_t chip8;
+    if (!load_chip8(&chip8, rom, rom_size))
+        return 0;
+    chip8.rng = 1;
+    chip8.vip_timing = data[0] & 1;
+    chip8.quirks = (data[0] >> 1) & QUIRK_ALL;
+
+#ifdef FUZZ_DIFF
+    chip8.vip_timing = false; // Compare instruction by instruction
+    static chip8_t other, scratch, base;
+    clone_chip8(&other, &chip8);
+    clone_chip8(&base, &chip8);
+#endif
+
+    for (uint32_t f = 0; f < (frames ? frames : 1); f++) {
+        const uint16_t held = frames ? keys[2 * f] | keys[2 * f + 1] << 8 : 0;
+
+#ifdef FUZZ_DIFF
+        for (uint8_t k = 0; k < sizeof chip8.keypad; k++)
+            chip8.keypad[k] = held & (1u << k);
+        memcpy(other.keypad, chip8.keypad, sizeof other.keypad);
+        for (uint32_t i = 0; i < config.clk_speed / 60; i++) {
+            emulate_instruct(&chip8, &config);
+            clone_chip8(&scratch, &other);
+            emulate_instruct(&scratch, &config);
+            clone_chip8(&other, &scratch);
+            if (!same_chip8(&chip8, &other)) {
+                fprintf(stderr, "Diverged at frame %u after opcode 0x%04X\n",
+                        f, chip8.inst.opcode);
+                abort();
+            }
+        }
+        update_timers(&other);
+#else
+        // Keys that change land part way into the frame, key N at N/16
+        input_queue_t input = {0};
+        for (uint8_t k = 0; k < sizeof chip8.keypad; k++) {
+            if (chip8.keypad[k] != (bool)(held & (1u << k)))
+                input.events[input.count++] = (key_event_t){
+                    .at = k << 12, .key = k, .down = held & (1u << k)};
+        }
+        emulate_frame(&chip8, &config, &input);
+#endif
+        update_timers(&chip8);
+    }
+
+#ifdef FUZZ_DIFF
+    load_chip8(&scratch, rom, rom_size);
+    if (!same_ram(&base, &scratch)) {
+        fprintf(stderr, "Write leaked into a shared ram page\n");
+        abort();
+    }
+#endif
+    return 0;
+}
+#endif
+
+#ifndef FUZZ
 //====================== MAIN ======================//
 
 int main(int argc, char **argv) {
 
     // Default startup message
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <rom_name> \n", argv[0]);
+        fprintf(stderr,
+                "Usage: %s [--shm <name>] [--record <file>] "
+                "[--run-ahead <frames>] [--watch] [--debugger] \n"
+                "       [--vip] [--stats | --stats-file <file>] "
+                "[--trace <file.json>] \n"
+                "       [--quirks <profile> | --detect-quirks] "
+                "[--catalog <file>] <rom_name> \n"
+                "       %s [--tile <sessions>] <rom_name>... \n"
+                "       %s --convert <recording> <out.pbm> \n"
+                "       %s [--catalog <file>] --scan <rom_dir>... \n"
+                "       %s --server <socket | -> \n",
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
         exit(EXIT_FAILURE);
     }
 
     // initialize configurations
     config_t config = {0};
-    if (!init_config(&config))
+    if (!init_config(&config, argc, argv))
         exit(EXIT_FAILURE);
 
+    // Offline conversion of a recording; no emulation needed
+    if (config.convert_in)
+        exit(convert_recording(&config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    // Headless job server; no window or SDL needed
+    if (config.server_name) {
+        const bool ok = run_server(&config);
+        free(config.rom_names);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Offline ROM catalog build; the arguments are directories, not ROMs
+    if (config.scan) {
+        const bool ok = build_catalog(&config);
+        free(config.rom_names);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     // Initialize SDL
     sdl_t sdl = {0};
     if (!init_sdl(&sdl, &config))
         exit(EXIT_FAILURE);
 
+    // Several machines tiled in one window; the single machine features below
+    // (debugger, run ahead, recording, ...) are not available there
+    if (config.sessions > 1) {
+        const bool ok = run_sessions(&sdl, &config);
+        free(config.rom_names);
+        final_cleanup(&sdl);
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     // Initiazlie chip8 machine
-    char *rom_name = argv[1];
     chip8_t chip8 = {0};
-    if (!init_chip8(&chip8, rom_name))
+    if (!init_chip8(&chip8, config.rom_name))
+        exit(EXIT_FAILURE);
+
+    // Per-ROM clock speed, quirks and keys from the catalog
+    catalog_t catalog;
+    if (!init_catalog(&catalog, &config))
+        exit(EXIT_FAILURE);
+    apply_rom_settings(&config, &catalog, &chip8);
+
+    // Guess quirks for ROMs of unknown origin; --quirks and the catalog win
+    if (config.detect_quirks && !config.quirks_set)
+        config.quirks = detect_quirks(&config, &chip8);
+    chip8.quirks = config.quirks;
+    chip8.vip_timing = config.vip_timing;
+
+    // Initialize optional shared memory frame export
+    shm_t shm = {0};
+    if (!init_shm(&shm, &config))
+        exit(EXIT_FAILURE);
+
+    // Initialize optional ROM file watcher for hot reloading
+    rom_watch_t watch = {0};
+    if (!init_rom_watch(&watch, &config))
+        exit(EXIT_FAILURE);
+
+    // Initialize optional background recorder
+    recorder_t *rec = calloc(1, sizeof *rec);
+    if (!rec || !init_recorder(rec, &config))
         exit(EXIT_FAILURE);
 
     // Initial clear screen
     clear_screen(&sdl, &config);
 
-    // Seed random number generator
-    srand(time(NULL));
+    // Seed random number generator (xorshift state must not be 0)
+    chip8.rng = (uint32_t)time(NULL) | 1;
 
-    // Runtime loop
-    while (chip8.state != QUIT) {
+    // Key changes waiting for their place in the next frame
+    input_queue_t input = {.last_poll = SDL_GetTicks()};
+
+    // Scratch machine used to run ahead of the shown frame
+    chip8_t ahead = {0};
 
-        handle_input(&chip8);
+    // Runtime debugger, idle until F1/--debugger or a breakpoint is set
+    debugger_t dbg = {.step_over = -1};
 
-        // Pause for debugging
-        if (chip8.state == PAUSED)
+    // Window and UI state changed by keys and window events
+    host_t host = {.debug_break = config.debugger};
+
+    // Performance counters for the HUD and --stats
+    stats_t stats;
+    init_stats(&stats);
+
+    // Optional frame timeline tracer
+    tracer_t tracer;
+    if (!init_tracer(&tracer, &config))
+        exit(EXIT_FAILURE);
+
+    // 60Hz frame deadlines
+    pacer_t pacer;
+    init_pacer(&pacer);
+
+    // Runtime loop
+    for (uint64_t frame = 0; chip8.state != QUIT; frame++) {
+
+        const uint64_t frame_start = SDL_GetPerformanceCounter();
+        handle_input(&chip8, &config, &host, &input);
+        update_rom_watch(&watch, &chip8);
+        trace(&tracer, SPAN_INPUT, frame_start, SDL_GetPerformanceCounter());
+
+        // Pause for debugging; sleep until there is input, then restart
+        // pacing so the paused time is not caught up on
+        if (chip8.state == PAUSED) {
+            flush_input(&chip8, &input);
+            wait_input(&config);
+            init_pacer(&pacer);
             continue;
+        }
 
         // Get time before running instructions
         uint64_t before_inst = SDL_GetPerformanceCounter();
 
-        for (uint32_t i = 0; i < config.clk_speed / 60; i++) {
-            emulate_instruct(&chip8, &config);
+        if (host.debug_break) {
+            host.debug_break = false;
+            dbg.steps = 1; // Stop before the next instruction
         }
 
-        // Get time after running instruction
+        // Swap in the debugger's checked loop only while it has work to do.
+        // It takes input at the frame boundary.
+        if (debugger_active(&dbg))
+            flush_input(&chip8, &input);
+        const uint32_t instructions =
+            debugger_active(&dbg) ? debugger_frame(&dbg, &chip8, &config)
+                                  : emulate_frame(&chip8, &config, &input);
+
+        // Get time after running instruction, then sleep until the frame is
+        // due
         uint64_t after_inst = SDL_GetPerformanceCounter();
-        double time_elapsed = (double)((after_inst - before_inst) / 1000) /
-                              SDL_GetPerformanceFrequency();
-        SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
-        update_screen(&sdl, &config, &chip8);
+        wait_frame(&pacer);
+        const uint64_t after_delay = SDL_GetPerformanceCounter();
+
+        // Skip drawing, and the run ahead only drawing needs, while the
+        // window is hidden or at a reduced rate while it is out of focus
+        const bool render = should_render(&host, frame);
+        if (render && config.run_ahead) {
+            // Run a copy a few frames into the future with the current input
+            // and show that instead, hiding the ROM's input polling latency.
+            // The real machine carries on from the current frame.
+            clone_chip8(&ahead, &chip8);
+            for (uint32_t i = 0; i < config.run_ahead; i++) {
+                update_timers(&ahead);
+                emulate_frame(&ahead, &config, NULL);
+            }
+        }
+        const uint64_t after_ahead = SDL_GetPerformanceCounter();
+
+        if (render) {
+            update_screen(&sdl, &config, config.run_ahead ? &ahead : &chip8);
+            if (host.hud)
+                draw_hud(&sdl, &config, &stats);
+        }
+        const uint64_t after_render = SDL_GetPerformanceCounter();
+
+        if (render)
+            SDL_RenderPresent(sdl.rend);
+        const uint64_t after_present = SDL_GetPerformanceCounter();
+
+        stats.emu_ticks += (after_inst - before_inst) +
+                           (after_ahead - after_delay);
+        stats.sleep_ticks += after_delay - after_inst;
+        stats.render_ticks += after_render - after_ahead;
+        stats.present_ticks += after_present - after_render;
+        update_stats(&stats, &config, instructions);
+
+        update_shm(&shm, &chip8);
+        update_recorder(rec, &chip8);
+        const uint64_t before_timers = SDL_GetPerformanceCounter();
         update_timers(&chip8);
+        const uint64_t frame_end = SDL_GetPerformanceCounter();
+
+        trace(&tracer, SPAN_EMULATE, before_inst, after_inst);
+        trace(&tracer, SPAN_DELAY, after_inst, after_delay);
+        if (render && config.run_ahead)
+            trace(&tracer, SPAN_RUN_AHEAD, after_delay, after_ahead);
+        trace(&tracer, SPAN_SCREEN, after_ahead, after_render);
+        trace(&tracer, SPAN_PRESENT, after_render, after_present);
+        trace(&tracer, SPAN_TIMERS, before_timers, frame_end);
+        trace(&tracer, SPAN_FRAME, frame_start, frame_end);
     }
 
+#ifdef COVERAGE
+    write_coverage(&chip8, &config);
+#endif
+
+    write_trace(&tracer, &config);
+
+    cleanup_chip8(&ahead);
+    cleanup_chip8(&chip8);
+    cleanup_rom_watch(&watch);
+    cleanup_catalog(&catalog);
+    cleanup_recorder(rec);
+    free(rec);
+    cleanup_shm(&shm, &config);
+    if (config.stats_file && config.stats_file != stderr)
+        fclose(config.stats_file);
+    free(config.rom_names);
     final_cleanup(&sdl);
-}
\ No newline at end of file
+}
+#endif